@@ -0,0 +1,140 @@
+// Binding lookup microbenchmark: the compiled [button1][button2] tables,
+// merged per interned (instance, class) pair, against the linear scan
+// with strcmp over the parsed bindings they replaced.
+//
+//   build/bench-lookup [config] [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "parser.h"
+#include "eeka.h"
+#include "intern.h"
+
+int verbose = 0;
+
+void msg(int priority, const char* format, ...) {
+    if (!verbose && priority > LOG_WARNING) return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+// The lookup as it was before the tables, kept here as the baseline
+static const Action* scan_bindings(const KeyBinding* bindings, int count, int first_button, int second_button) {
+    for (int i = 0; i < count; i++) {
+        if (second_button > 0) {
+            if (bindings[i].button1 == first_button && bindings[i].button2 == second_button) {
+                return &bindings[i].action;
+            }
+        }
+        else if (bindings[i].button1 == first_button && bindings[i].button2 == 0) {
+            return &bindings[i].action;
+        }
+    }
+    return NULL;
+}
+
+static const Action* scan_window(const Config* cfg, const char* instance, const char* class_name,
+                                 int first_button, int second_button) {
+    for (int i = 0; i < cfg->window_rule_count; i++) {
+        const WindowRule* rule = &cfg->window_rules[i];
+        if (rule->instance[0] && strcmp(rule->instance, instance) != 0) continue;
+        if (rule->class_name[0] && strcmp(rule->class_name, class_name) != 0) continue;
+        const Action* action = scan_bindings(&cfg->rule_bindings[rule->first_binding], rule->binding_count,
+                                             first_button, second_button);
+        if (action) return action;
+    }
+    return scan_bindings(cfg->bindings, cfg->binding_count, first_button, second_button);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Button pairs a modifier held with the wheel or another button produces
+static const int pairs[][2] = {
+    { RBUTTON, SCROLL_UP }, { RBUTTON, SCROLL_DOWN }, { RBUTTON, MBUTTON },
+    { LBUTTON, SCROLL_UP }, { LBUTTON, RBUTTON },     { BBUTTON, 0 },
+    { FBUTTON, 0 },         { SCROLL_UP, 0 },          { MBUTTON, LBUTTON },
+};
+#define PAIR_COUNT (int)(sizeof(pairs) / sizeof(pairs[0]))
+
+int main(int argc, char *argv[]) {
+    const char* config_path = argc > 1 ? argv[1] : "data/config";
+    long iterations = argc > 2 ? atol(argv[2]) : 10000000;
+
+    if (parse_config_file(config_path) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    const Config* cfg = get_config();
+    const char* instance = "no-such-instance";
+    const char* class_name = "NoSuchClass";
+    if (cfg->window_rule_count > 0) {
+        // Last rule, so the scan has to walk past all the others
+        const WindowRule* rule = &cfg->window_rules[cfg->window_rule_count - 1];
+        if (rule->instance[0]) instance = rule->instance;
+        if (rule->class_name[0]) class_name = rule->class_name;
+    }
+
+    uint32_t instance_id = intern(instance);
+    uint32_t class_id = intern(class_name);
+
+    // Both paths must agree before their speed means anything
+    for (int i = 0; i < PAIR_COUNT; i++) {
+        if (scan_window(cfg, instance, class_name, pairs[i][0], pairs[i][1]) !=
+            get_action_for_window(instance_id, class_id, pairs[i][0], pairs[i][1])) {
+            fprintf(stderr, "Lookup mismatch for %d + %d\n", pairs[i][0], pairs[i][1]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uintptr_t sink = 0;
+    double start, scan_global, table_global, scan_rule, table_rule;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        const int* p = pairs[i % PAIR_COUNT];
+        sink += (uintptr_t)scan_bindings(cfg->bindings, cfg->binding_count, p[0], p[1]);
+    }
+    scan_global = (now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        const int* p = pairs[i % PAIR_COUNT];
+        sink += (uintptr_t)get_action_for_buttons(p[0], p[1]);
+    }
+    table_global = (now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        const int* p = pairs[i % PAIR_COUNT];
+        sink += (uintptr_t)scan_window(cfg, instance, class_name, p[0], p[1]);
+    }
+    scan_rule = (now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        const int* p = pairs[i % PAIR_COUNT];
+        sink += (uintptr_t)get_action_for_window(instance_id, class_id, p[0], p[1]);
+    }
+    table_rule = (now_ns() - start) / iterations;
+
+    printf("config %s: %d bindings, %d window rules, %ld lookups\n",
+           config_path, cfg->binding_count, cfg->window_rule_count, iterations);
+    printf("  global  scan %6.2f ns  table %6.2f ns\n", scan_global, table_global);
+    printf("  window  scan %6.2f ns  table %6.2f ns  (%s, %s)\n", scan_rule, table_rule, instance, class_name);
+
+    free_config();
+    intern_free();
+    return sink == 1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
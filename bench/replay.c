@@ -0,0 +1,1172 @@
+// Replay benchmark: feeds synthetic or recorded evdev frames through
+// process_evdev_events() and the button state machine, with every X
+// call answered by the mock backend below after a simulated round trip.
+// main.c is built with its main() renamed, so the decision logic under
+// test is exactly the daemon's.
+//
+//   build/bench-replay [-d rtt_us] [-i xtest|uinput] [-n frames] [-r trace]
+//                      [-H hogs] [-R[cpu]] [-I idle_ms] config...
+//
+// Frames that fire a shortcut wait for the injector thread to send it,
+// gaps included, giving the end-to-end action latency of the chosen
+// backend.
+//
+// A trace is either a file written by eeka --record, replayed over
+// mock windows with the recorded WM_CLASS, or a raw stream of struct
+// input_event as read from a /dev/input/event* node.
+//
+// -H starts that many busy threads at normal priority and paces the
+// frames like a 1 kHz mouse, each stamped with the time it was due, so
+// the frame percentiles and the "evdev to read" histogram show how late
+// the loop woke up under load. -R applies the daemon's --realtime mode
+// to the loop first, optionally pinned to a CPU, for comparison.
+//
+// -I runs the daemon's own event loop over the first config instead,
+// with a mouse that stays silent for that many milliseconds, and fails
+// unless the loop slept the whole time: no wakeup and no timeout. A
+// wheel burst with every notch parked follows, which fails if a round
+// leaves rate limited ticks without a timeout to send them.
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/xtest.h>
+#include <xcb/xcb_keysyms.h>
+#include <linux/input.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "parser.h"
+#include "eeka.h"
+#include "mouse.h"
+#include "keymap.h"
+#include "inject.h"
+#include "window.h"
+#include "intern.h"
+#include "record.h"
+#include "latency.h"
+#include "realtime.h"
+#include "scroll.h"
+
+extern xcb_connection_t *connection;
+extern xcb_screen_t *screen;
+void process_evdev_events(MouseDevice* mouse);
+void process_parked_events(void);
+int init_signals(void);
+int init_event_loop(void);
+int loop_round(const char* config_path);
+int loop_timeout(void);
+extern unsigned long loop_wakeups;
+extern unsigned long loop_timeouts;
+extern int running;
+
+#define MAX_FRAME 16
+#define MAX_WINDOWS 64
+#define ROOT_WINDOW 1
+#define FIRST_FRAME 0x1000
+
+typedef struct {
+    struct input_event events[MAX_FRAME];
+    int count;
+    int window;     // index of the window under the pointer
+    const char* wm_instance;    // recorded window, NULL when none was resolved
+    const char* wm_class;
+} Frame;
+
+// What the mock server knows: a frame window and its client per rule
+typedef struct {
+    char wm_class[512];
+    int wm_class_len;
+} MockWindow;
+
+static MockWindow windows[MAX_WINDOWS];
+static int window_count = 0;
+static int pointer_window = 0;
+static xcb_window_t focused_window = XCB_NONE;
+
+static long rtt_ns = 0;
+static unsigned long x_requests = 0;
+static unsigned long x_round_trips = 0;
+
+// Every request gets a sequence number. A flush sends the requests since
+// the last one as a batch, whose replies arrive together one round trip
+// later; only waiting for a batch that is not in yet blocks.
+enum { MOCK_VOID, MOCK_QUERY_POINTER, MOCK_QUERY_TREE, MOCK_GET_PROPERTY, MOCK_INTERN_ATOM, MOCK_QUERY_KEYMAP };
+
+typedef struct {
+    int kind;
+    xcb_window_t window;
+    unsigned int batch;
+} MockRequest;
+
+#define MOCK_REQUESTS 4096
+static MockRequest mock_requests[MOCK_REQUESTS];
+static unsigned int next_sequence = 1;
+static unsigned int batches_sent = 0;
+static unsigned int batches_arrived = 0;
+static uint64_t batch_ready_at[MOCK_REQUESTS];
+
+// Requests are written to /dev/null on flush, as to the X socket
+static int x_sink = -1;
+static size_t x_pending = 0;
+static char x_buffer[65536];
+static unsigned long shortcuts = 0;
+static unsigned long key_presses = 0;
+
+// The virtual keyboard is a pipe here, never a real device
+static int keyboard_pipe[2] = { -1, -1 };
+
+#define PACED_FRAME_NS 1000000
+
+static int hog_count = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static unsigned int request(size_t size, int kind, xcb_window_t window) {
+    x_requests++;
+    x_pending += size;
+    unsigned int sequence = next_sequence++;
+    mock_requests[sequence % MOCK_REQUESTS] = (MockRequest){ kind, window, batches_sent + 1 };
+    return sequence;
+}
+
+static void flush_requests(void) {
+    if (x_pending == 0) return;
+    while (x_pending > 0) {
+        size_t size = x_pending < sizeof(x_buffer) ? x_pending : sizeof(x_buffer);
+        if (write(x_sink, x_buffer, size) < 0) break;
+        x_pending -= size;
+    }
+    x_pending = 0;
+    batches_sent++;
+    batch_ready_at[batches_sent % MOCK_REQUESTS] = now_ns() + rtt_ns;
+}
+
+// Spin rather than sleep, a blocked reply wait is what is being modelled
+static void wait_reply(unsigned int sequence) {
+    unsigned int batch = mock_requests[sequence % MOCK_REQUESTS].batch;
+    if (batch > batches_sent) flush_requests();
+    if (batch <= batches_arrived) return;
+
+    x_round_trips++;
+    uint64_t until = batch_ready_at[batch % MOCK_REQUESTS];
+    while (now_ns() < until);
+    batches_arrived = batch;
+}
+
+// What xcb_poll_for_reply() sees: nothing before the batch is in
+static int reply_arrived(unsigned int sequence) {
+    unsigned int batch = mock_requests[sequence % MOCK_REQUESTS].batch;
+    if (batch > batches_sent) return 0;
+    if (batch > batches_arrived) {
+        if (now_ns() < batch_ready_at[batch % MOCK_REQUESTS]) return 0;
+        batches_arrived = batch;
+    }
+    return 1;
+}
+
+static xcb_window_t frame_window(int index) {
+    return FIRST_FRAME + index * 2;
+}
+
+static int client_index(xcb_window_t window) {
+    int index = (int)(window - FIRST_FRAME - 1) / 2;
+    return window > FIRST_FRAME && (window - FIRST_FRAME) % 2 == 1 && index < window_count ? index : -1;
+}
+
+// --- Mock X backend ---------------------------------------------------
+
+static xcb_screen_t mock_screen = { .root = ROOT_WINDOW };
+static char mock_connection;
+
+// The injector thread opens a second connection. Its requests need no
+// reply, so they are only counted, atomically, and never touch the
+// request table the main thread uses.
+static char mock_inject_connection;
+static int connections = 0;
+static unsigned long inject_requests = 0;
+
+#define IS_INJECTOR(c) ((c) == (xcb_connection_t *)&mock_inject_connection)
+
+xcb_connection_t *xcb_connect(const char *display, int *screen_num) {
+    (void)display;
+    (void)screen_num;
+    return (xcb_connection_t *)(connections++ == 0 ? &mock_connection : &mock_inject_connection);
+}
+
+int xcb_connection_has_error(xcb_connection_t *c) { (void)c; return 0; }
+void xcb_disconnect(xcb_connection_t *c) { (void)c; }
+// Read end of a pipe nobody writes to, for the -I loop to watch
+static int x_fd = -1;
+
+int xcb_get_file_descriptor(xcb_connection_t *c) { (void)c; return x_fd; }
+int xcb_flush(xcb_connection_t *c) {
+    if (!IS_INJECTOR(c)) flush_requests();
+    return 1;
+}
+// Events the mock server has for us, handed out like xcb_poll_for_event() does
+static xcb_generic_event_t* event_queue[MAX_WINDOWS * 2];
+static int event_head = 0;
+static int event_count = 0;
+
+static void queue_event(const void* event, size_t size) {
+    if (event_count == (int)(sizeof(event_queue) / sizeof(event_queue[0]))) return;
+    xcb_generic_event_t* copy = malloc(sizeof(xcb_generic_event_t) > size ? sizeof(xcb_generic_event_t) : size);
+    if (!copy) return;
+    memcpy(copy, event, size);
+    event_queue[(event_head + event_count++) % (sizeof(event_queue) / sizeof(event_queue[0]))] = copy;
+}
+
+// Events all go to the loop's connection
+xcb_generic_event_t *xcb_poll_for_event(xcb_connection_t *c) {
+    if (IS_INJECTOR(c) || event_count == 0) return NULL;
+    xcb_generic_event_t* event = event_queue[event_head];
+    event_head = (event_head + 1) % (sizeof(event_queue) / sizeof(event_queue[0]));
+    event_count--;
+    return event;
+}
+// The mock has no socket, every event it queued has been read
+xcb_generic_event_t *xcb_poll_for_queued_event(xcb_connection_t *c) {
+    return xcb_poll_for_event(c);
+}
+
+const struct xcb_setup_t *xcb_get_setup(xcb_connection_t *c) { (void)c; return NULL; }
+
+xcb_screen_iterator_t xcb_setup_roots_iterator(const xcb_setup_t *setup) {
+    (void)setup;
+    xcb_screen_iterator_t it = { .data = &mock_screen, .rem = 1 };
+    return it;
+}
+
+xcb_void_cookie_t xcb_change_window_attributes(xcb_connection_t *c, xcb_window_t window,
+                                               uint32_t value_mask, const void *value_list) {
+    (void)c; (void)value_mask; (void)value_list;
+    request(16, MOCK_VOID, window);
+    return (xcb_void_cookie_t){0};
+}
+
+xcb_void_cookie_t xcb_set_input_focus(xcb_connection_t *c, uint8_t revert_to, xcb_window_t focus,
+                                      xcb_timestamp_t time) {
+    (void)revert_to; (void)time;
+    if (IS_INJECTOR(c)) {
+        __atomic_add_fetch(&inject_requests, 1, __ATOMIC_RELAXED);
+    } else {
+        request(12, MOCK_VOID, focus);
+    }
+    __atomic_store_n(&focused_window, focus, __ATOMIC_RELAXED);
+    return (xcb_void_cookie_t){0};
+}
+
+xcb_void_cookie_t xcb_test_fake_input(xcb_connection_t *c, uint8_t type, uint8_t detail, uint32_t time,
+                                      xcb_window_t root, int16_t x, int16_t y, uint8_t deviceid) {
+    (void)detail; (void)time; (void)x; (void)y; (void)deviceid;
+    if (IS_INJECTOR(c)) {
+        __atomic_add_fetch(&inject_requests, 1, __ATOMIC_RELAXED);
+    } else {
+        request(36, MOCK_VOID, root);
+    }
+    if (type == XCB_KEY_PRESS) __atomic_add_fetch(&key_presses, 1, __ATOMIC_RELAXED);
+    return (xcb_void_cookie_t){0};
+}
+
+// The reply the mock server sends for a request
+static void *mock_reply(unsigned int sequence) {
+    const MockRequest* req = &mock_requests[sequence % MOCK_REQUESTS];
+
+    switch (req->kind) {
+        case MOCK_QUERY_POINTER: {
+            xcb_query_pointer_reply_t *reply = calloc(1, sizeof(*reply));
+            if (reply && req->window == ROOT_WINDOW) {
+                reply->child = frame_window(pointer_window);
+            }
+            return reply;
+        }
+        case MOCK_QUERY_TREE: {
+            // The children follow the reply, as they do on the wire. The mock
+            // windows announce themselves with CreateNotify instead, and each
+            // frame holds its client.
+            xcb_query_tree_reply_t *reply = calloc(1, sizeof(*reply) + sizeof(xcb_window_t));
+            if (reply && req->window != ROOT_WINDOW && client_index(req->window) < 0) {
+                reply->children_len = 1;
+                *(xcb_window_t *)(reply + 1) = req->window + 1;
+            }
+            return reply;
+        }
+        case MOCK_GET_PROPERTY: {
+            if (req->window == ROOT_WINDOW) {
+                // _NET_ACTIVE_WINDOW, the mock window manager follows focus
+                xcb_get_property_reply_t *reply = calloc(1, sizeof(*reply) + sizeof(xcb_window_t));
+                if (reply) {
+                    reply->type = XCB_ATOM_WINDOW;
+                    reply->format = 32;
+                    reply->value_len = 1;
+                    reply->length = 1;
+                    *(xcb_window_t *)(reply + 1) = __atomic_load_n(&focused_window, __ATOMIC_RELAXED);
+                }
+                return reply;
+            }
+            // Clients answer WM_CLASS for any property, which also stands in for
+            // their WM_STATE. Frames have neither.
+            int index = client_index(req->window);
+            int len = index >= 0 ? windows[index].wm_class_len : 0;
+
+            xcb_get_property_reply_t *reply = calloc(1, sizeof(*reply) + len);
+            if (reply && len > 0) {
+                reply->type = XCB_ATOM_STRING;
+                reply->format = 8;
+                reply->value_len = len;
+                reply->length = (len + 3) / 4;
+                memcpy(reply + 1, windows[index].wm_class, len);
+            }
+            return reply;
+        }
+        case MOCK_INTERN_ATOM: {
+            xcb_intern_atom_reply_t *reply = calloc(1, sizeof(*reply));
+            if (reply) reply->atom = 300;
+            return reply;
+        }
+        case MOCK_QUERY_KEYMAP:
+            return calloc(1, sizeof(xcb_query_keymap_reply_t));
+    }
+    return NULL;
+}
+
+void *xcb_wait_for_reply(xcb_connection_t *c, unsigned int request, xcb_generic_error_t **e) {
+    (void)c; (void)e;
+    wait_reply(request);
+    return mock_reply(request);
+}
+
+int xcb_poll_for_reply(xcb_connection_t *c, unsigned int request, void **reply, xcb_generic_error_t **error) {
+    (void)c;
+    if (error) *error = NULL;
+    if (!reply_arrived(request)) return 0;
+    *reply = mock_reply(request);
+    return 1;
+}
+
+void xcb_discard_reply(xcb_connection_t *c, unsigned int sequence) {
+    (void)c;
+    (void)sequence;
+}
+
+xcb_query_pointer_cookie_t xcb_query_pointer(xcb_connection_t *c, xcb_window_t window) {
+    (void)c;
+    return (xcb_query_pointer_cookie_t){ request(8, MOCK_QUERY_POINTER, window) };
+}
+
+xcb_query_pointer_reply_t *xcb_query_pointer_reply(xcb_connection_t *c, xcb_query_pointer_cookie_t cookie,
+                                                   xcb_generic_error_t **e) {
+    return xcb_wait_for_reply(c, cookie.sequence, e);
+}
+
+xcb_query_tree_cookie_t xcb_query_tree(xcb_connection_t *c, xcb_window_t window) {
+    (void)c;
+    return (xcb_query_tree_cookie_t){ request(8, MOCK_QUERY_TREE, window) };
+}
+
+xcb_query_tree_reply_t *xcb_query_tree_reply(xcb_connection_t *c, xcb_query_tree_cookie_t cookie,
+                                             xcb_generic_error_t **e) {
+    return xcb_wait_for_reply(c, cookie.sequence, e);
+}
+
+xcb_window_t *xcb_query_tree_children(const xcb_query_tree_reply_t *reply) {
+    return (xcb_window_t *)(reply + 1);
+}
+
+int xcb_query_tree_children_length(const xcb_query_tree_reply_t *reply) {
+    return reply->children_len;
+}
+
+xcb_get_property_cookie_t xcb_get_property(xcb_connection_t *c, uint8_t _delete, xcb_window_t window,
+                                           xcb_atom_t property, xcb_atom_t type,
+                                           uint32_t long_offset, uint32_t long_length) {
+    (void)c; (void)_delete; (void)property; (void)type; (void)long_offset; (void)long_length;
+    return (xcb_get_property_cookie_t){ request(24, MOCK_GET_PROPERTY, window) };
+}
+
+xcb_get_property_reply_t *xcb_get_property_reply(xcb_connection_t *c, xcb_get_property_cookie_t cookie,
+                                                 xcb_generic_error_t **e) {
+    return xcb_wait_for_reply(c, cookie.sequence, e);
+}
+
+void *xcb_get_property_value(const xcb_get_property_reply_t *reply) {
+    return (void *)(reply + 1);
+}
+
+int xcb_get_property_value_length(const xcb_get_property_reply_t *reply) {
+    return reply->value_len * (reply->format / 8);
+}
+
+xcb_intern_atom_cookie_t xcb_intern_atom(xcb_connection_t *c, uint8_t only_if_exists,
+                                         uint16_t name_len, const char *name) {
+    (void)c; (void)only_if_exists; (void)name;
+    return (xcb_intern_atom_cookie_t){ request(8 + name_len, MOCK_INTERN_ATOM, XCB_NONE) };
+}
+
+xcb_intern_atom_reply_t *xcb_intern_atom_reply(xcb_connection_t *c, xcb_intern_atom_cookie_t cookie,
+                                               xcb_generic_error_t **e) {
+    return xcb_wait_for_reply(c, cookie.sequence, e);
+}
+
+xcb_query_keymap_cookie_t xcb_query_keymap(xcb_connection_t *c) {
+    (void)c;
+    return (xcb_query_keymap_cookie_t){ request(4, MOCK_QUERY_KEYMAP, XCB_NONE) };
+}
+
+xcb_query_keymap_reply_t *xcb_query_keymap_reply(xcb_connection_t *c, xcb_query_keymap_cookie_t cookie,
+                                                 xcb_generic_error_t **e) {
+    return xcb_wait_for_reply(c, cookie.sequence, e);
+}
+
+// Every keysym gets its own keycode on level 0
+static xcb_keysym_t mock_keysyms[256];
+static int next_keycode = 8;
+
+xcb_key_symbols_t *xcb_key_symbols_alloc(xcb_connection_t *c) {
+    (void)c;
+    return (xcb_key_symbols_t *)&mock_connection;
+}
+
+void xcb_key_symbols_free(xcb_key_symbols_t *syms) { (void)syms; }
+
+xcb_keysym_t xcb_key_symbols_get_keysym(xcb_key_symbols_t *syms, xcb_keycode_t keycode, int col) {
+    (void)syms;
+    return col == 0 ? mock_keysyms[keycode] : 0;
+}
+
+xcb_keycode_t *xcb_key_symbols_get_keycode(xcb_key_symbols_t *syms, xcb_keysym_t keysym) {
+    (void)syms;
+    int code = 8;
+    while (code < next_keycode && mock_keysyms[code] != keysym) code++;
+    if (code == next_keycode) {
+        if (next_keycode == 256) return NULL;
+        mock_keysyms[next_keycode++] = keysym;
+    }
+
+    xcb_keycode_t *codes = calloc(2, sizeof(*codes));
+    if (codes) codes[0] = code;
+    return codes;
+}
+
+// --- Event streams ----------------------------------------------------
+
+static unsigned int rng_state = 2463534242u;
+
+static unsigned int next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void add_event(Frame* frame, int type, int code, int value) {
+    if (frame->count < MAX_FRAME - 1) {
+        frame->events[frame->count++] = (struct input_event){ .type = type, .code = code, .value = value };
+    }
+}
+
+static int end_frame(Frame* frames, int count, int max) {
+    Frame* frame = &frames[count];
+    frame->events[frame->count++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT };
+    return count + 1 < max ? count + 1 : count;
+}
+
+static int add_button(Frame* frames, int count, int max, int code, int value) {
+    add_event(&frames[count], EV_MSC, MSC_SCAN, 0x90000 + (code & 0xf));
+    add_event(&frames[count], EV_KEY, code, value);
+    return end_frame(frames, count, max);
+}
+
+static int add_motion(Frame* frames, int count, int max, int steps) {
+    for (int i = 0; i < steps; i++) {
+        add_event(&frames[count], EV_REL, REL_X, (int)(next_random() % 7) - 3);
+        add_event(&frames[count], EV_REL, REL_Y, (int)(next_random() % 7) - 3);
+        count = end_frame(frames, count, max);
+    }
+    return count;
+}
+
+static int add_scroll(Frame* frames, int count, int max, int notches) {
+    int direction = next_random() & 1 ? 1 : -1;
+    for (int i = 0; i < notches; i++) {
+        add_event(&frames[count], EV_REL, REL_WHEEL, direction);
+        add_event(&frames[count], EV_REL, REL_WHEEL_HI_RES, direction * 120);
+        count = end_frame(frames, count, max);
+    }
+    return count;
+}
+
+// A desktop session in miniature: mostly motion, with plain scrolling,
+// clicks and modifier gestures on windows picked from the config rules
+static int generate_frames(Frame* frames, int max) {
+    int count = 0;
+    int window = 0;
+    memset(frames, 0, sizeof(Frame) * max);
+
+    while (count < max - 32) {
+        int start = count;
+        unsigned int gesture = next_random() % 100;
+
+        count = add_motion(frames, count, max, 4 + next_random() % 16);
+
+        if (gesture < 15) {
+            count = add_scroll(frames, count, max, 1 + next_random() % 4);
+        } else if (gesture < 25) {
+            count = add_button(frames, count, max, BTN_RIGHT, 1);
+            count = add_scroll(frames, count, max, 1 + next_random() % 3);
+            count = add_button(frames, count, max, BTN_RIGHT, 0);
+        } else if (gesture < 30) {
+            count = add_button(frames, count, max, BTN_RIGHT, 1);
+            count = add_button(frames, count, max, BTN_MIDDLE, 1);
+            count = add_button(frames, count, max, BTN_MIDDLE, 0);
+            count = add_button(frames, count, max, BTN_RIGHT, 0);
+        } else if (gesture < 40) {
+            count = add_button(frames, count, max, BTN_LEFT, 1);
+            count = add_motion(frames, count, max, 1 + next_random() % 4);
+            count = add_button(frames, count, max, BTN_LEFT, 0);
+        } else if (gesture < 45) {
+            count = add_button(frames, count, max, BTN_SIDE, 1);
+            count = add_button(frames, count, max, BTN_SIDE, 0);
+        } else if (gesture < 48) {
+            count = add_button(frames, count, max, BTN_RIGHT, 1);
+            count = add_button(frames, count, max, BTN_RIGHT, 0);
+        } else if (gesture < 50) {
+            // A free-spinning wheel, a notch per frame
+            count = add_button(frames, count, max, BTN_RIGHT, 1);
+            count = add_scroll(frames, count, max, 16 + next_random() % 16);
+            count = add_button(frames, count, max, BTN_RIGHT, 0);
+        }
+
+        // The pointer usually stays on a window for a few gestures
+        if (next_random() % 100 < 20) window = next_random() % window_count;
+        for (int i = start; i < count; i++) frames[i].window = window;
+    }
+    return count;
+}
+
+typedef struct {
+    Frame* frames;
+    int count;
+    int capacity;
+} FrameList;
+
+// Frames end at SYN_REPORT, oversized ones are cut
+static int append_event(FrameList* list, const struct input_event* ev) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 4096;
+        Frame* grown = realloc(list->frames, capacity * sizeof(Frame));
+        if (!grown) return 0;
+        memset(grown + list->capacity, 0, (capacity - list->capacity) * sizeof(Frame));
+        list->frames = grown;
+        list->capacity = capacity;
+    }
+
+    Frame* frame = &list->frames[list->count];
+    frame->events[frame->count++] = *ev;
+    if ((ev->type == EV_SYN && ev->code == SYN_REPORT) || frame->count == MAX_FRAME) {
+        list->count++;
+    }
+    return 1;
+}
+
+// Names defined by the trace, kept until exit since frames point at them
+static char** trace_names = NULL;
+static int trace_name_count = 0;
+
+static const char* keep_name(const char* name, size_t len) {
+    char** grown = realloc(trace_names, (trace_name_count + 1) * sizeof(*grown));
+    if (!grown) return NULL;
+    trace_names = grown;
+    return trace_names[trace_name_count++] = strndup(name, len);
+}
+
+// Walk an eeka --record file in place
+static int load_recording(const char* data, size_t size, FrameList* list) {
+    const RecordHeader* header = (const RecordHeader*)data;
+    if (header->version != RECORD_VERSION || header->entry_size != sizeof(RecordEntry)) {
+        fprintf(stderr, "Unsupported trace version %u\n", header->version);
+        return -1;
+    }
+
+    const RecordEntry* entries = (const RecordEntry*)(data + sizeof(RecordHeader));
+    size_t entry_count = (size - sizeof(RecordHeader)) / sizeof(RecordEntry);
+
+    // Session ids to names, reset by each RECORD_SESSION
+    const char** names = NULL;
+    uint32_t name_capacity = 0;
+
+    for (size_t i = 0; i < entry_count; i++) {
+        const RecordEntry* entry = &entries[i];
+
+        if (entry->kind == RECORD_SESSION) {
+            memset(names, 0, name_capacity * sizeof(*names));
+        } else if (entry->kind == RECORD_NAME) {
+            size_t len = entry->value;
+            if (i + RECORD_NAME_ENTRIES(len) >= entry_count) break;
+            if (entry->instance >= name_capacity) {
+                uint32_t capacity = name_capacity ? name_capacity : 64;
+                while (capacity <= entry->instance) capacity *= 2;
+                const char** grown = realloc(names, capacity * sizeof(*names));
+                if (!grown) break;
+                memset(grown + name_capacity, 0, (capacity - name_capacity) * sizeof(*names));
+                names = grown;
+                name_capacity = capacity;
+            }
+            names[entry->instance] = keep_name((const char*)(entry + 1), len);
+            i += RECORD_NAME_ENTRIES(len);
+        } else if (entry->kind == RECORD_EVENT) {
+            struct input_event ev = { .type = entry->type, .code = entry->code, .value = entry->value };
+            int index = list->count;
+            if (!append_event(list, &ev)) break;
+
+            // The first window resolved within a frame is the one it went to
+            Frame* frame = &list->frames[index];
+            if ((entry->instance || entry->class_name) && !frame->wm_class) {
+                frame->wm_instance = entry->instance < name_capacity ? names[entry->instance] : NULL;
+                frame->wm_class = entry->class_name < name_capacity ? names[entry->class_name] : NULL;
+                if (!frame->wm_class) frame->wm_class = "";
+            }
+        }
+    }
+
+    free(names);
+    return 0;
+}
+
+static int load_trace(const char* path, Frame** out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+
+    FrameList list = {0};
+    int status = 0;
+    if ((size_t)st.st_size >= sizeof(RecordHeader) && memcmp(data, RECORD_MAGIC, sizeof(RECORD_MAGIC)) == 0) {
+        status = load_recording(data, st.st_size, &list);
+    } else {
+        const struct input_event* events = (const struct input_event*)data;
+        size_t count = st.st_size / sizeof(struct input_event);
+        for (size_t i = 0; i < count && append_event(&list, &events[i]); i++);
+    }
+    munmap((void*)data, st.st_size);
+
+    if (list.count < list.capacity && list.frames[list.count].count > 0) list.count++;
+    *out = list.frames;
+    return status < 0 ? -1 : list.count;
+}
+
+// --- Harness ----------------------------------------------------------
+
+static int add_window(const char* instance, const char* class_name) {
+    int len = snprintf(NULL, 0, "%s%c%s", instance, '\0', class_name) + 1;
+
+    for (int i = 0; i < window_count; i++) {
+        if (windows[i].wm_class_len == len &&
+            strcmp(windows[i].wm_class, instance) == 0 &&
+            strcmp(windows[i].wm_class + strlen(instance) + 1, class_name) == 0) {
+            return i;
+        }
+    }
+    if (window_count == MAX_WINDOWS) return window_count - 1;
+
+    MockWindow* w = &windows[window_count];
+    w->wm_class_len = snprintf(w->wm_class, sizeof(w->wm_class), "%s%c%s", instance, '\0', class_name) + 1;
+    return window_count++;
+}
+
+static void count_keyboard_presses(void) {
+    struct input_event events[64];
+    ssize_t bytes;
+    while (keyboard_pipe[0] >= 0 && (bytes = read(keyboard_pipe[0], events, sizeof(events))) > 0) {
+        for (size_t i = 0; i < bytes / sizeof(struct input_event); i++) {
+            if (events[i].type == EV_KEY && events[i].value == 1) {
+                __atomic_add_fetch(&key_presses, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+// What the main loop does when the X connection is readable
+static void dispatch_x_events(void) {
+    xcb_generic_event_t *event;
+    while ((event = xcb_poll_for_event(connection)) != NULL) {
+        window_cache_handle_event(event);
+        keymap_handle_event(event);
+        free(event);
+    }
+}
+
+// The pointer crosses from one mock window into another
+static void move_pointer(int window) {
+    xcb_leave_notify_event_t leave = {
+        .response_type = XCB_LEAVE_NOTIFY, .event = frame_window(pointer_window),
+        .detail = XCB_NOTIFY_DETAIL_NONLINEAR, .mode = XCB_NOTIFY_MODE_NORMAL,
+    };
+    xcb_enter_notify_event_t enter = {
+        .response_type = XCB_ENTER_NOTIFY, .event = frame_window(window),
+        .detail = XCB_NOTIFY_DETAIL_NONLINEAR, .mode = XCB_NOTIFY_MODE_NORMAL,
+    };
+    queue_event(&leave, sizeof(leave));
+    queue_event(&enter, sizeof(enter));
+    pointer_window = window;
+    dispatch_x_events();
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int run_config(const char* config_path, Frame* trace, int trace_count, int frame_count) {
+    if (parse_config_file(config_path) < 0) {
+        return -1;
+    }
+
+    window_count = 0;
+    window_cache_clear();
+    const Config* cfg = get_config();
+    for (int i = 0; i < cfg->window_rule_count; i++) {
+        const WindowRule* rule = &cfg->window_rules[i];
+        add_window(rule->instance[0] ? rule->instance : "any", rule->class_name[0] ? rule->class_name : "Any");
+    }
+    add_window("xterm", "XTerm");
+    keymap_build(connection);
+
+    Frame* frames = trace;
+    if (!frames) {
+        frames = malloc(sizeof(Frame) * frame_count);
+        if (!frames) return -1;
+        frame_count = generate_frames(frames, frame_count);
+    } else {
+        frame_count = trace_count;
+        // Recorded windows become mock ones and the pointer stays on a
+        // window until another is resolved. A raw dump has none, so
+        // the pointer moves between the rule windows now and then.
+        int recorded = 0;
+        for (int i = 0; i < frame_count; i++) {
+            if (frames[i].wm_class) {
+                recorded = 1;
+                frames[i].window = add_window(frames[i].wm_instance ? frames[i].wm_instance : "", frames[i].wm_class);
+            } else {
+                frames[i].window = recorded ? frames[i - 1].window : (i / 256) % window_count;
+            }
+        }
+    }
+
+    for (int i = 0; i < window_count; i++) {
+        xcb_create_notify_event_t create = {
+            .response_type = XCB_CREATE_NOTIFY, .parent = ROOT_WINDOW, .window = frame_window(i),
+        };
+        queue_event(&create, sizeof(create));
+        dispatch_x_events();
+    }
+    move_pointer(0);
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    MouseDevice* mouse = &mice[0];
+    memset(mouse, 0, sizeof(*mouse));
+    mouse_count = 1;
+    snprintf(mouse->device_path, sizeof(mouse->device_path), "replay");
+    mouse->fd = pipe_fds[0];
+    mouse->clock_monotonic = 1;
+    mouse->output.fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    uint64_t* times = malloc(sizeof(uint64_t) * frame_count);
+    uint64_t* action_times = malloc(sizeof(uint64_t) * frame_count);
+    if (!times || !action_times) return -1;
+    int action_count = 0;
+    unsigned long events = 0;
+    x_requests = x_round_trips = shortcuts = 0;
+    __atomic_store_n(&inject_requests, 0, __ATOMIC_RELAXED);
+    unsigned long dropped_before = inject_dropped();
+
+    uint64_t total = 0;
+    unsigned long parked_frames = 0;
+    uint64_t due = now_ns();
+    for (int i = 0; i < frame_count; i++) {
+        Frame* frame = &frames[i];
+        if (frame->window != pointer_window) {
+            move_pointer(frame->window);
+        }
+        uint64_t stamp;
+        if (hog_count > 0) {
+            due += PACED_FRAME_NS;
+            struct timespec at = { .tv_sec = due / 1000000000u, .tv_nsec = due % 1000000000u };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+            stamp = due;
+        } else {
+            stamp = now_ns();
+        }
+        for (int e = 0; e < frame->count; e++) {
+            frame->events[e].input_event_sec = stamp / 1000000000u;
+            frame->events[e].input_event_usec = stamp % 1000000000u / 1000;
+        }
+        if (write(pipe_fds[1], frame->events, frame->count * sizeof(struct input_event)) < 0) {
+            perror("write");
+            break;
+        }
+
+        unsigned long presses_before = __atomic_load_n(&key_presses, __ATOMIC_RELAXED);
+        uint64_t start = now_ns();
+        process_evdev_events(mouse);
+        uint64_t end = now_ns();
+        times[i] = end - (hog_count > 0 ? stamp : start);
+        total += end - start;
+        events += frame->count;
+
+        // A mouse reports every millisecond at best, so the replies a
+        // frame was parked for are in before the next one; the daemon
+        // is free to handle other input meanwhile
+        if (mouse->parked_len > 0) {
+            parked_frames++;
+        }
+        while (mouse->parked_len > 0) {
+            process_parked_events();
+        }
+
+        // Until the last step is out, gaps included
+        while (inject_pending()) {
+            sched_yield();
+        }
+        uint64_t done = now_ns();
+        count_keyboard_presses();
+
+        if (__atomic_load_n(&key_presses, __ATOMIC_RELAXED) != presses_before) {
+            shortcuts++;
+            action_times[action_count++] = done - start;
+            // Waiting for the shortcut is the bench's doing, not the
+            // loop's, so paced frames restart from here
+            if (due < done) due = done;
+        }
+    }
+
+    qsort(times, frame_count, sizeof(uint64_t), compare_u64);
+    qsort(action_times, action_count, sizeof(uint64_t), compare_u64);
+
+    printf("config %s: %d frames, %lu events, %d windows, rtt %ld us\n",
+           config_path, frame_count, events, window_count, rtt_ns / 1000);
+    printf("  %.0f events/s  %s p50 %.2f us  p90 %.2f us  p99 %.2f us  max %.2f us\n",
+           events / (total / 1e9), hog_count > 0 ? "due to handled" : "frame",
+           times[frame_count / 2] / 1e3, times[frame_count * 9 / 10] / 1e3,
+           times[frame_count * 99 / 100] / 1e3, times[frame_count - 1] / 1e3);
+    printf("  %.3f X requests/event  %.3f blocking round trips/event  %lu frames parked  %lu shortcuts  %lu frames written  %lu dropped\n",
+           (double)(x_requests + __atomic_load_n(&inject_requests, __ATOMIC_RELAXED)) / events, (double)x_round_trips / events, parked_frames, shortcuts,
+           mouse->output.frames_written, mouse->output.frames_dropped);
+    if (action_count > 0) {
+        printf("  %s shortcut end to end p50 %.2f us  p90 %.2f us  p99 %.2f us  max %.2f us  %lu stale\n",
+               inject_backend == INJECT_UINPUT ? "uinput" : "xtest",
+               action_times[action_count / 2] / 1e3, action_times[action_count * 9 / 10] / 1e3,
+               action_times[action_count * 99 / 100] / 1e3, action_times[action_count - 1] / 1e3,
+               inject_dropped() - dropped_before);
+    }
+    if (hog_count > 0) {
+        verbose = 1;
+        latency_dump();
+        verbose = 0;
+    }
+
+    free(times);
+    free(action_times);
+    if (!trace) free(frames);
+    close(mouse->output.fd);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    mouse->fd = mouse->output.fd = -1;
+    keymap_free();
+    free_config();
+    scroll_reset();
+    return 0;
+}
+
+// Normal priority whatever the loop runs at, and never inheriting -R
+static void* hog_main(void* arg) {
+    (void)arg;
+    volatile unsigned long spins = 0;
+    for (;;) spins++;
+    return NULL;
+}
+
+static int start_hogs(int count) {
+    pthread_attr_t attr;
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, hog_main, NULL) != 0) {
+            perror("pthread_create");
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+static int idle_ms = 0;
+static unsigned long idle_wakeups;
+
+static void* idle_stopper_main(void* arg) {
+    (void)arg;
+    struct timespec sleep = { .tv_sec = idle_ms / 1000, .tv_nsec = (idle_ms % 1000) * 1000000L };
+    nanosleep(&sleep, NULL);
+    // The SIGTERM ending the loop wakes it, so count before sending it
+    idle_wakeups = __atomic_load_n(&loop_wakeups, __ATOMIC_RELAXED);
+    kill(getpid(), SIGTERM);
+    return NULL;
+}
+
+// Nothing to do: a mouse that never sends, and no wheel ticks, retries
+// or records pending, must leave the loop asleep
+static int check_idle(const char* config_path) {
+    int timeout = loop_timeout();
+    pthread_t stopper;
+    if (pthread_create(&stopper, NULL, idle_stopper_main, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    while (running) {
+        if (loop_round(config_path) < 0) break;
+    }
+    pthread_join(stopper, NULL);
+    running = 1;
+
+    int ok = timeout == -1 && idle_wakeups == 0 && loop_timeouts == 0;
+    printf("%s: idle %d ms, timeout %d, %lu wakeups, %lu timeouts: %s\n", config_path, idle_ms,
+           timeout, idle_wakeups, loop_timeouts, ok ? "ok" : "FAILED");
+    return ok ? 0 : -1;
+}
+
+// Runs a round for a frame the loop has yet to read, and fails when it
+// leaves wheel ticks held back without a timeout to send them
+static int loop_frame(const char* config_path, int fd, Frame* frame) {
+    uint64_t stamp = now_ns();
+    for (int e = 0; e < frame->count; e++) {
+        frame->events[e].input_event_sec = stamp / 1000000000u;
+        frame->events[e].input_event_usec = stamp % 1000000000u / 1000;
+    }
+    if (write(fd, frame->events, frame->count * sizeof(struct input_event)) < 0) {
+        perror("write");
+        return -1;
+    }
+    loop_round(config_path);
+    return scroll_pending() && loop_timeout() < 0 ? -1 : 0;
+}
+
+// A wheel spun with the right button held, each notch parked for its
+// window's WM_CLASS: the ticks the rate limiter holds back are queued
+// by the loop's last parked event pass and still need their timeout
+static int check_parked_burst(const char* config_path, int fd) {
+    Frame frames[40];
+    memset(frames, 0, sizeof(frames));
+    int count = add_button(frames, 0, 40, BTN_RIGHT, 1);
+    int notches = count;
+    count = add_scroll(frames, count, 40, 32);
+    int release = count;
+    count = add_button(frames, count, 40, BTN_RIGHT, 0);
+
+    int failed = 0;
+    for (int i = 0; i < count && !failed; i++) {
+        if (i == release) {
+            // Until the held ticks are out, which no input wakes the loop for
+            for (int rounds = 0; scroll_pending() && !failed && rounds < 1000; rounds++) {
+                failed = loop_timeout() < 0;
+                if (!failed) loop_round(config_path);
+            }
+        }
+        if (i >= notches && i < release) window_cache_clear();
+        failed = failed || loop_frame(config_path, fd, &frames[i]);
+    }
+
+    printf("%s: parked wheel burst of %d notches: %s\n", config_path, release - notches,
+           failed ? "ticks held without a timeout, FAILED" : "ok");
+    return failed ? -1 : 0;
+}
+
+// Runs main.c's own loop over the first config with the mock X server
+// and a mouse the checks write to
+static int run_loop(const char* config_path) {
+    if (parse_config_file(config_path) < 0) {
+        return -1;
+    }
+    window_count = 0;
+    window_cache_clear();
+    add_window("xterm", "XTerm");
+    move_pointer(0);
+    keymap_build(connection);
+
+    int x_pipe[2];
+    int mouse_pipe[2];
+    if (pipe2(x_pipe, O_NONBLOCK | O_CLOEXEC) < 0 || pipe2(mouse_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    x_fd = x_pipe[0];
+
+    MouseDevice* mouse = &mice[0];
+    memset(mouse, 0, sizeof(*mouse));
+    mouse_count = 1;
+    snprintf(mouse->device_path, sizeof(mouse->device_path), "loop");
+    mouse->fd = mouse_pipe[0];
+    mouse->grabbed = 1;
+    mouse->clock_monotonic = 1;
+    mouse->output.fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    if (init_event_loop() < 0) {
+        return -1;
+    }
+
+    int status = check_idle(config_path);
+    if (check_parked_burst(config_path, mouse_pipe[1]) < 0) {
+        status = -1;
+    }
+
+    close(mouse->output.fd);
+    close(mouse_pipe[0]);
+    close(mouse_pipe[1]);
+    close(x_pipe[0]);
+    close(x_pipe[1]);
+    x_fd = -1;
+    mouse_count = 0;
+    keymap_free();
+    free_config();
+    scroll_reset();
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    int frame_count = 0;
+    const char* trace_path = NULL;
+    int realtime = 0;
+    int realtime_cpu = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:i:n:r:H:R::I:")) != -1) {
+        switch (opt) {
+            case 'd': rtt_ns = atol(optarg) * 1000; break;
+            case 'i': inject_backend = strcmp(optarg, "uinput") == 0 ? INJECT_UINPUT : INJECT_XTEST; break;
+            case 'n': frame_count = atoi(optarg); break;
+            case 'r': trace_path = optarg; break;
+            case 'H': hog_count = atoi(optarg); break;
+            case 'I': idle_ms = atoi(optarg); break;
+            case 'R':
+                realtime = 1;
+                realtime_cpu = optarg ? atoi(optarg) : -1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d rtt_us] [-i xtest|uinput] [-n frames] [-r trace] "
+                        "[-H hogs] [-R[cpu]] [-I idle_ms] config...\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    // Paced frames take a millisecond each
+    if (frame_count == 0) frame_count = hog_count > 0 ? 5000 : 200000;
+    if (frame_count < 64) frame_count = 64;
+
+    Frame* trace = NULL;
+    int trace_count = 0;
+    if (trace_path && (trace_count = load_trace(trace_path, &trace)) <= 0) {
+        return EXIT_FAILURE;
+    }
+
+    connection = xcb_connect(NULL, NULL);
+    screen = &mock_screen;
+    x_sink = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    init_focus_tracking(connection);
+    init_pointer_tracking(connection);
+
+    if (start_hogs(hog_count) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (realtime) {
+        verbose = 1;
+        realtime_enable(realtime_cpu);
+        verbose = 0;
+    }
+
+    // The loop reads its signals from a signalfd, so like the daemon
+    // they are blocked before the injector thread starts
+    if (idle_ms > 0 && init_signals() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // Shortcuts must not reach the desktop, so no real virtual keyboard
+    InjectBackend backend = inject_backend;
+    inject_backend = INJECT_XTEST;
+    if (init_injector() < 0) {
+        return EXIT_FAILURE;
+    }
+    if (backend == INJECT_UINPUT) {
+        if (pipe2(keyboard_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            perror("pipe");
+            return EXIT_FAILURE;
+        }
+        inject_uinput_fd = keyboard_pipe[1];
+        inject_backend = INJECT_UINPUT;
+    }
+
+    int status = EXIT_SUCCESS;
+    if (idle_ms > 0) {
+        status = run_loop(optind < argc ? argv[optind] : "data/config") < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else {
+        for (int i = optind; i < argc; i++) {
+            if (run_config(argv[i], trace, trace_count, frame_count) < 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+        if (optind == argc) {
+            status = run_config("data/config", trace, trace_count, frame_count) < 0 ? EXIT_FAILURE : status;
+        }
+    }
+
+    // The injector would destroy a device, the pipe is ours to close
+    inject_uinput_fd = -1;
+    cleanup_injector();
+    if (keyboard_pipe[0] >= 0) {
+        close(keyboard_pipe[0]);
+        close(keyboard_pipe[1]);
+    }
+    close(x_sink);
+    cleanup_window_tracking();
+    intern_free();
+    for (int i = 0; i < trace_name_count; i++) free(trace_names[i]);
+    free(trace_names);
+    free(trace);
+    return status;
+}
@@ -0,0 +1,4 @@
+/* Generated by makefile */
+#define VERSION "0.1"
+#define PROGRAM_NAME "eeka"
+#define DATA_DIR "/usr/share/eeka"
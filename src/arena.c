@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Bump allocator for everything a config snapshot owns. Allocations are
+// never freed one by one, the whole snapshot goes with arena_free().
+
+#define ARENA_ALIGN 16
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaChunk* chunk = arena->head;
+    if (!chunk || chunk->used + size > chunk->size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        arena->head = chunk;
+    }
+
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+char* arena_strdup(Arena* arena, const char* str) {
+    size_t len = strlen(str);
+    char* copy = arena_alloc(arena, len + 1);
+    if (copy) {
+        memcpy(copy, str, len + 1);
+    }
+    return copy;
+}
+
+// Make room for one more item in a contiguous array. The array doubles
+// and moves; the old copy stays in the arena until the arena is freed.
+int arena_reserve(Arena* arena, void** items, int* capacity, int count, size_t item_size) {
+    if (count < *capacity) {
+        return 1;
+    }
+
+    int grown_capacity = *capacity ? *capacity * 2 : 16;
+    void* grown = arena_alloc(arena, grown_capacity * item_size);
+    if (!grown) {
+        return 0;
+    }
+    if (count > 0) {
+        memcpy(grown, *items, count * item_size);
+    }
+
+    *items = grown;
+    *capacity = grown_capacity;
+    return 1;
+}
+
+void arena_free(Arena* arena) {
+    ArenaChunk* chunk = arena->head;
+    while (chunk) {
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+}
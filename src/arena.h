@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t used;
+    size_t size;
+    unsigned char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk* head;
+} Arena;
+
+void* arena_alloc(Arena* arena, size_t size);
+char* arena_strdup(Arena* arena, const char* str);
+int   arena_reserve(Arena* arena, void** items, int* capacity, int count, size_t item_size);
+void  arena_free(Arena* arena);
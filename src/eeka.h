@@ -1,6 +1,7 @@
 #pragma once
 
 #include <syslog.h>
+#include <stdint.h>
 
 extern int verbose;
 
@@ -30,6 +31,15 @@ void msg(int priority, const char* format, ...);
 #define XK_Up           0xff52  
 #define XK_Right        0xff53
 #define XK_Down         0xff54
+#define XK_Shift_L      0xffe1
+#define XK_Control_L    0xffe3
+#define XK_Alt_L        0xffe9
+#define XK_Super_L      0xffeb
+#define XK_ISO_Level3_Shift 0xfe03
+
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define test_bit(nr, addr) (((1UL << ((nr) % BITS_PER_LONG)) & ((addr)[(nr) / BITS_PER_LONG])) != 0)
 
 #define MOD_SHIFT 0x01
 #define MOD_CTRL  0x02
@@ -48,22 +58,17 @@ void msg(int priority, const char* format, ...);
 #define XCB_KEY_META_R      XCB_KEY_ALT_R
 
 typedef enum {
-    LBUTTON     = 1,
-    MBUTTON     = 2,
-    RBUTTON     = 3,
-    SCROLL_UP   = 4,
-    SCROLL_DOWN = 5,
-    BUTTON6     = 6,
-    BUTTON7     = 7,
-    BBUTTON     = 8,
-    FBUTTON     = 9 
+    LBUTTON      = 1,
+    MBUTTON      = 2,
+    RBUTTON      = 3,
+    SCROLL_UP    = 4,
+    SCROLL_DOWN  = 5,
+    SCROLL_LEFT  = 6,
+    SCROLL_RIGHT = 7,
+    BBUTTON      = 8,
+    FBUTTON      = 9 
 } MouseButton;
 
-typedef struct {
-    int mouse_fd;
-    char device_path[256];
-} EvdevContext;
-
 typedef struct {
     int modifier_pressed;
     int combo_used;
@@ -73,9 +78,10 @@ typedef struct {
     int blacklisted_count;
 } ButtonState;
 
+// Interned WM_CLASS names, see intern.h
 typedef struct {
-    char instance[256];
-    char class_name[256];
+    uint32_t instance;
+    uint32_t class_name;
     int valid;
 } WindowClassInfo;
 
@@ -0,0 +1,166 @@
+#include <sys/inotify.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "hotplug.h"
+#include "eeka.h"
+
+// /dev/input is watched with inotify so devices are attached and
+// detached while the daemon runs. A new node is often created before
+// udev has set its permissions, so it is kept as pending until an
+// IN_ATTRIB makes it readable; the time from the node appearing to the
+// device being attached is logged.
+
+int hotplug_fd = -1;
+
+typedef struct {
+    char name[32];
+    struct timespec seen;
+} PendingNode;
+
+static PendingNode pending[HOTPLUG_PENDING_SIZE];
+
+static long elapsed_us(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static PendingNode* find_pending(const char* name) {
+    for (int i = 0; i < HOTPLUG_PENDING_SIZE; i++) {
+        if (pending[i].name[0] && strcmp(pending[i].name, name) == 0) {
+            return &pending[i];
+        }
+    }
+    return NULL;
+}
+
+static PendingNode* add_pending(const char* name) {
+    PendingNode* node = find_pending(name);
+    if (node) return node;
+
+    // Full table, the oldest entry gives way
+    node = &pending[0];
+    for (int i = 0; i < HOTPLUG_PENDING_SIZE; i++) {
+        if (!pending[i].name[0]) {
+            node = &pending[i];
+            break;
+        }
+        if (pending[i].seen.tv_sec < node->seen.tv_sec ||
+            (pending[i].seen.tv_sec == node->seen.tv_sec && pending[i].seen.tv_nsec < node->seen.tv_nsec)) {
+            node = &pending[i];
+        }
+    }
+
+    snprintf(node->name, sizeof(node->name), "%s", name);
+    clock_gettime(CLOCK_MONOTONIC, &node->seen);
+    return node;
+}
+
+static void device_added(const char* name, const HotplugHandlers* handlers) {
+    char path[280];
+    snprintf(path, sizeof(path), "/dev/input/%s", name);
+
+    PendingNode* node = add_pending(name);
+
+    // Still root only, wait for udev to change the mode
+    if (access(path, R_OK) != 0) {
+        return;
+    }
+
+    if (find_mouse(path) || find_keyboard(path)) {
+        node->name[0] = '\0';
+        return;
+    }
+
+    MouseDevice* mouse = open_mouse(path);
+    if (mouse) {
+        msg(LOG_NOTICE, "Attached mouse %s %ld us after it appeared", path, elapsed_us(&node->seen));
+        if (handlers->mouse_attached) handlers->mouse_attached(mouse);
+    } else {
+        KeyboardDevice* keyboard = open_keyboard(path);
+        if (keyboard) {
+            msg(LOG_NOTICE, "Attached keyboard %s %ld us after it appeared", path, elapsed_us(&node->seen));
+            if (handlers->keyboard_attached) handlers->keyboard_attached(keyboard);
+        }
+    }
+
+    node->name[0] = '\0';
+}
+
+static void device_removed(const char* name) {
+    char path[280];
+    snprintf(path, sizeof(path), "/dev/input/%s", name);
+
+    PendingNode* node = find_pending(name);
+    if (node) node->name[0] = '\0';
+
+    // Usually the read already failed with ENODEV and closed it
+    MouseDevice* mouse = find_mouse(path);
+    if (mouse) {
+        msg(LOG_NOTICE, "Mouse %s removed", path);
+        close_mouse(mouse);
+    }
+
+    KeyboardDevice* keyboard = find_keyboard(path);
+    if (keyboard) {
+        msg(LOG_NOTICE, "Keyboard %s removed", path);
+        close_keyboard(keyboard);
+    }
+}
+
+int init_hotplug(void) {
+    memset(pending, 0, sizeof(pending));
+
+    hotplug_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (hotplug_fd < 0) {
+        msg(LOG_WARNING, "Cannot create inotify instance, hotplug disabled: %s", strerror(errno));
+        return -1;
+    }
+
+    if (inotify_add_watch(hotplug_fd, "/dev/input", IN_CREATE | IN_ATTRIB | IN_DELETE) < 0) {
+        msg(LOG_WARNING, "Cannot watch /dev/input, hotplug disabled: %s", strerror(errno));
+        close(hotplug_fd);
+        hotplug_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void cleanup_hotplug(void) {
+    if (hotplug_fd >= 0) {
+        close(hotplug_fd);
+        hotplug_fd = -1;
+    }
+}
+
+void process_hotplug_events(const HotplugHandlers* handlers) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t bytes = read(hotplug_fd, buffer, sizeof(buffer));
+        if (bytes <= 0) {
+            if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                msg(LOG_ERR, "Error reading hotplug events: %s", strerror(errno));
+            }
+            return;
+        }
+
+        for (char* p = buffer; p < buffer + bytes; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->len == 0 || strncmp(ev->name, "event", 5) != 0) continue;
+
+            if (ev->mask & IN_DELETE) {
+                device_removed(ev->name);
+            } else if (ev->mask & (IN_CREATE | IN_ATTRIB)) {
+                device_added(ev->name, handlers);
+            }
+        }
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "mouse.h"
+#include "keyboard.h"
+
+#define HOTPLUG_PENDING_SIZE 16
+
+typedef struct {
+    void (*mouse_attached)(MouseDevice* mouse);
+    void (*keyboard_attached)(KeyboardDevice* keyboard);
+} HotplugHandlers;
+
+extern int hotplug_fd;
+
+int  init_hotplug(void);
+void cleanup_hotplug(void);
+void process_hotplug_events(const HotplugHandlers* handlers);
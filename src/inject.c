@@ -0,0 +1,303 @@
+#include <xcb/xtest.h>
+#include <linux/uinput.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "inject.h"
+#include "keymap.h"
+#include "eeka.h"
+#include "latency.h"
+
+// Synthetic input is sent by a thread of its own over its own X
+// connection, so focus changes, XTest requests and the gaps between the
+// steps never hold up evdev reading and uinput forwarding. Each resolved
+// action, the steps of one shortcut or click, is handed over through a
+// single-producer/single-consumer ring, and an eventfd wakes the thread.
+//
+// An action has a deadline counted from the mouse event behind it. One
+// the thread only gets to later, because X was slow, is dropped and
+// counted rather than sent late.
+//
+// The thread is also where the keycode table is rebuilt, see keymap.c,
+// the one X request that has to wait for its reply after startup.
+//
+// With the uinput backend the key steps between two gaps are collected
+// as evdev events and written to the virtual keyboard at once, so a
+// whole chord is one write() instead of an XTest request per key.
+
+int inject_uinput_fd = -1;
+InjectBackend inject_backend = INJECT_XTEST;
+
+typedef struct {
+    InjectStep steps[INJECT_ACTION_STEPS];
+    int count;
+    uint64_t origin;        // kernel time of the mouse event
+    uint64_t deadline;
+} InjectAction;
+
+static xcb_connection_t *inject_conn = NULL;
+static pthread_t inject_thread;
+static int thread_running = 0;
+static int wake_fd = -1;
+
+// The main thread only moves the tail and the injector only the head,
+// each published with release and read with acquire ordering
+static InjectAction ring[INJECT_RING_SIZE];
+static unsigned int ring_head = 0;
+static unsigned int ring_tail = 0;
+static int stopping = 0;
+static unsigned long stale_dropped = 0;
+
+// Key press or release plus its SYN_REPORT for every step of an action
+static struct input_event chord[INJECT_ACTION_STEPS * 2];
+static int chord_len = 0;
+
+static void chord_add(uint16_t type, uint16_t code, int32_t value) {
+    chord[chord_len++] = (struct input_event){ .type = type, .code = code, .value = value };
+}
+
+static void chord_write(void) {
+    if (chord_len == 0) return;
+
+    ssize_t size = chord_len * sizeof(struct input_event);
+    if (write(inject_uinput_fd, chord, size) != size) {
+        msg(LOG_ERR, "Cannot write keys to the virtual keyboard: %s", strerror(errno));
+    }
+    chord_len = 0;
+}
+
+static void run_step(const InjectStep* step) {
+    int key_step = step->type == XCB_KEY_PRESS || step->type == XCB_KEY_RELEASE;
+
+    if (key_step && inject_backend == INJECT_UINPUT) {
+        // X keycodes are evdev codes shifted by 8
+        chord_add(EV_KEY, step->detail - 8, step->type == XCB_KEY_PRESS);
+        chord_add(EV_SYN, SYN_REPORT, 0);
+    } else if (step->type == INJECT_FOCUS) {
+        xcb_set_input_focus(inject_conn, XCB_INPUT_FOCUS_POINTER_ROOT, step->window, XCB_CURRENT_TIME);
+    } else {
+        xcb_test_fake_input(inject_conn, step->type, step->detail, XCB_CURRENT_TIME,
+                            step->window, step->x, step->y, 0);
+    }
+}
+
+static void send_steps(const InjectAction* action, int* sent) {
+    chord_write();
+    xcb_flush(inject_conn);
+
+    // Only the first flush counts, the gaps are by design
+    if (!*sent) {
+        latency_record(LATENCY_INJECT, action->origin);
+        *sent = 1;
+    }
+}
+
+static void sleep_us(unsigned int us) {
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+// Steps run until one asks for a gap, which the thread sleeps through
+static void run_action(const InjectAction* action, int skip_gaps) {
+    int sent = 0;
+
+    for (int i = 0; i < action->count; i++) {
+        const InjectStep* step = &action->steps[i];
+        run_step(step);
+
+        if (step->delay_us > 0 && i + 1 < action->count && !skip_gaps) {
+            send_steps(action, &sent);
+            sleep_us(step->delay_us);
+        }
+    }
+    send_steps(action, &sent);
+}
+
+// No events are selected on this connection, but MappingNotify goes to
+// every client and would pile up unread
+static void discard_events(void) {
+    xcb_generic_event_t *event;
+    while ((event = xcb_poll_for_event(inject_conn)) != NULL) {
+        free(event);
+    }
+}
+
+static void* injector_main(void* arg) {
+    (void)arg;
+
+    for (;;) {
+        unsigned int head = ring_head;
+
+        keymap_serve(inject_conn);
+        discard_events();
+
+        if (head == __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE)) {
+            // Stopping with nothing queued, or wait for the next push
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) break;
+
+            uint64_t wakeups;
+            if (read(wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EINTR) {
+                msg(LOG_ERR, "Injector cannot wait for actions: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        const InjectAction* action = &ring[head % INJECT_RING_SIZE];
+        uint64_t now = latency_now();
+
+        if (now > action->deadline) {
+            unsigned long dropped = __atomic_add_fetch(&stale_dropped, 1, __ATOMIC_RELAXED);
+            msg(LOG_WARNING, "Dropping an action %llu ms after its event (%lu dropped so far)",
+                (unsigned long long)(now - action->origin) / 1000000, dropped);
+        } else {
+            // On the way out whatever is queued goes at once, no key may stay pressed
+            run_action(action, __atomic_load_n(&stopping, __ATOMIC_ACQUIRE));
+        }
+
+        __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void inject_wake(void) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        msg(LOG_ERR, "Cannot wake the injector: %s", strerror(errno));
+    }
+}
+
+static int open_virtual_keyboard(void) {
+    int fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        msg(LOG_ERR, "Cannot open /dev/uinput: %s", strerror(errno));
+        return -1;
+    }
+
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd, UI_SET_EVBIT, EV_SYN);
+
+    // Every code an X keycode can map to
+    for (int code = 1; code < 256 - 8; code++) {
+        ioctl(fd, UI_SET_KEYBIT, code);
+    }
+
+    struct uinput_user_dev udev = {0};
+    snprintf(udev.name, sizeof(udev.name), "eeka virtual keyboard");
+    udev.id.bustype = BUS_USB;
+    udev.id.vendor = 0x1234;
+    udev.id.product = 0x5679;
+    udev.id.version = 1;
+
+    if (write(fd, &udev, sizeof(udev)) != sizeof(udev) || ioctl(fd, UI_DEV_CREATE) < 0) {
+        msg(LOG_ERR, "Cannot create virtual keyboard: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    msg(LOG_NOTICE, "Created virtual device: eeka virtual keyboard");
+    return fd;
+}
+
+int init_injector(void) {
+    inject_conn = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(inject_conn)) {
+        msg(LOG_ERR, "Cannot open the injector's X connection");
+        xcb_disconnect(inject_conn);
+        inject_conn = NULL;
+        return -1;
+    }
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        msg(LOG_ERR, "Cannot create the injector's eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    if (inject_backend == INJECT_UINPUT && inject_uinput_fd < 0) {
+        inject_uinput_fd = open_virtual_keyboard();
+        if (inject_uinput_fd < 0) {
+            msg(LOG_WARNING, "Falling back to XTest for key injection");
+            inject_backend = INJECT_XTEST;
+        }
+    }
+
+    // A small stack, since --realtime's mlockall() locks all of it, and
+    // the loop thread's scheduling, real-time or not
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, INJECT_STACK_SIZE);
+    pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+    int err = pthread_create(&inject_thread, &attr, injector_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        msg(LOG_ERR, "Cannot start the injector thread: %s", strerror(err));
+        return -1;
+    }
+    thread_running = 1;
+    return 0;
+}
+
+void cleanup_injector(void) {
+    if (thread_running) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+        inject_wake();
+        pthread_join(inject_thread, NULL);
+        thread_running = 0;
+    }
+
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    if (inject_uinput_fd >= 0) {
+        ioctl(inject_uinput_fd, UI_DEV_DESTROY);
+        close(inject_uinput_fd);
+        inject_uinput_fd = -1;
+    }
+    if (inject_conn) {
+        xcb_disconnect(inject_conn);
+        inject_conn = NULL;
+    }
+}
+
+// Queued or running
+int inject_pending(void) {
+    return __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+}
+
+unsigned long inject_dropped(void) {
+    return __atomic_load_n(&stale_dropped, __ATOMIC_RELAXED);
+}
+
+int inject_push(const InjectStep* steps, int count) {
+    unsigned int tail = ring_tail;
+
+    if (count > INJECT_ACTION_STEPS) {
+        msg(LOG_WARNING, "Action of %d steps is too long, dropping it", count);
+        return 0;
+    }
+    if (tail - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == INJECT_RING_SIZE) {
+        msg(LOG_WARNING, "Injection queue full, dropping %d steps", count);
+        return 0;
+    }
+
+    InjectAction* action = &ring[tail % INJECT_RING_SIZE];
+    memcpy(action->steps, steps, count * sizeof(*steps));
+    action->count = count;
+    action->origin = latency_origin;
+    action->deadline = latency_origin + INJECT_DEADLINE_MS * 1000000ull;
+
+    __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+    inject_wake();
+    return 1;
+}
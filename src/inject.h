@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <xcb/xcb.h>
+
+// Actions queued for the injector thread, and steps per action
+#define INJECT_RING_SIZE 64
+#define INJECT_ACTION_STEPS 32
+
+// An action not started this long after its mouse event is dropped
+#define INJECT_DEADLINE_MS 250
+
+// The injector thread only runs send_steps() and libxcb
+#define INJECT_STACK_SIZE (256 * 1024)
+
+#define INJECT_FOCUS 0
+
+// Key steps go out as XTest requests, or as evdev events through a
+// virtual keyboard; button clicks and focus always use X
+typedef enum { INJECT_XTEST, INJECT_UINPUT } InjectBackend;
+
+typedef struct {
+    uint8_t type;           // XCB_KEY_PRESS/RELEASE, XCB_BUTTON_PRESS/RELEASE or INJECT_FOCUS
+    uint8_t detail;
+    xcb_window_t window;
+    int16_t x;
+    int16_t y;
+    unsigned int delay_us;  // gap before the next step runs
+} InjectStep;
+
+extern int inject_uinput_fd;
+extern InjectBackend inject_backend;
+
+int           init_injector(void);
+void          cleanup_injector(void);
+int           inject_push(const InjectStep* steps, int count);
+void          inject_wake(void);
+int           inject_pending(void);
+unsigned long inject_dropped(void);
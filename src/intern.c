@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "eeka.h"
+
+// Window class and instance names are interned once, when a window is
+// first seen or a rule is parsed, so matching is integer comparison.
+// Ids live for the whole run, a config reload keeps them valid.
+
+static char** names = NULL;
+static uint32_t name_count = 0;
+static uint32_t name_capacity = 0;
+
+// Open addressing, each slot holds an id, 0 marks a free slot
+static uint32_t* slots = NULL;
+static uint32_t slot_capacity = 0;
+
+static uint32_t hash_string(const char* str, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int grow_slots(void) {
+    uint32_t capacity = slot_capacity ? slot_capacity * 2 : 256;
+    uint32_t* grown = calloc(capacity, sizeof(*grown));
+    if (!grown) {
+        return 0;
+    }
+
+    for (uint32_t id = 1; id < name_count; id++) {
+        uint32_t slot = hash_string(names[id], strlen(names[id])) & (capacity - 1);
+        while (grown[slot]) slot = (slot + 1) & (capacity - 1);
+        grown[slot] = id;
+    }
+
+    free(slots);
+    slots = grown;
+    slot_capacity = capacity;
+    return 1;
+}
+
+static uint32_t lookup(const char* str, int len, uint32_t* free_slot) {
+    if (!slots) return INTERN_NONE;
+
+    uint32_t slot = hash_string(str, len) & (slot_capacity - 1);
+    while (slots[slot]) {
+        const char* name = names[slots[slot]];
+        if (strncmp(name, str, len) == 0 && name[len] == '\0') {
+            return slots[slot];
+        }
+        slot = (slot + 1) & (slot_capacity - 1);
+    }
+
+    if (free_slot) *free_slot = slot;
+    return INTERN_NONE;
+}
+
+uint32_t intern_len(const char* str, int len) {
+    if (!str || len <= 0 || str[0] == '\0') {
+        return INTERN_NONE;
+    }
+
+    uint32_t slot = 0;
+    uint32_t id = lookup(str, len, &slot);
+    if (id != INTERN_NONE) {
+        return id;
+    }
+
+    if (name_count == 0) {
+        names = calloc(64, sizeof(*names));
+        if (!names) return INTERN_NONE;
+        name_capacity = 64;
+        names[0] = "";
+        name_count = 1;
+    }
+
+    // Keep the table at most half full, then the probe is short
+    if ((name_count + 1) * 2 > slot_capacity) {
+        if (!grow_slots()) return INTERN_NONE;
+        lookup(str, len, &slot);
+    }
+
+    if (name_count == name_capacity) {
+        char** grown = realloc(names, name_capacity * 2 * sizeof(*names));
+        if (!grown) return INTERN_NONE;
+        names = grown;
+        name_capacity *= 2;
+    }
+
+    char* name = strndup(str, len);
+    if (!name) return INTERN_NONE;
+
+    id = name_count++;
+    names[id] = name;
+    slots[slot] = id;
+    return id;
+}
+
+uint32_t intern(const char* str) {
+    return str ? intern_len(str, strlen(str)) : INTERN_NONE;
+}
+
+uint32_t intern_find(const char* str) {
+    if (!str || str[0] == '\0') {
+        return INTERN_NONE;
+    }
+    return lookup(str, strlen(str), NULL);
+}
+
+const char* intern_name(uint32_t id) {
+    return id < name_count ? names[id] : "";
+}
+
+void intern_free(void) {
+    for (uint32_t id = 1; id < name_count; id++) {
+        free(names[id]);
+    }
+    free(names);
+    free(slots);
+    names = NULL;
+    slots = NULL;
+    name_count = name_capacity = slot_capacity = 0;
+}
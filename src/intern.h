@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+// Id 0 is the empty string, which window rules use as "any"
+#define INTERN_NONE 0
+
+uint32_t    intern(const char* str);
+uint32_t    intern_len(const char* str, int len);
+uint32_t    intern_find(const char* str);
+const char* intern_name(uint32_t id);
+void        intern_free(void);
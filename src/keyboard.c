@@ -0,0 +1,217 @@
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "keyboard.h"
+#include "mouse.h"
+#include "eeka.h"
+
+// Keyboards are opened read-only and never grabbed, they are only
+// used to know whether a keyboard modifier is held without asking
+// the X server (xcb_query_keymap) for every button or wheel event.
+
+KeyboardDevice keyboards[MAX_KEYBOARDS];
+int keyboard_count = 0;
+int keyboards_open = 0;
+unsigned int keyboard_modifiers = 0;
+
+static const unsigned int modifier_keys[] = {
+    KEY_LEFTCTRL, KEY_RIGHTCTRL,
+    KEY_LEFTSHIFT, KEY_RIGHTSHIFT,
+    KEY_LEFTALT, KEY_RIGHTALT,
+    KEY_LEFTMETA, KEY_RIGHTMETA,
+};
+
+#define MODIFIER_KEY_COUNT (sizeof(modifier_keys) / sizeof(modifier_keys[0]))
+
+static int modifier_bit(unsigned int code) {
+    for (size_t i = 0; i < MODIFIER_KEY_COUNT; i++) {
+        if (modifier_keys[i] == code) {
+            return 1 << i;
+        }
+    }
+    return 0;
+}
+
+static void update_keyboard_modifiers(void) {
+    keyboard_modifiers = 0;
+    for (int i = 0; i < keyboard_count; i++) {
+        keyboard_modifiers |= keyboards[i].modifiers;
+    }
+}
+
+// Read the current key state, used on open and after SYN_DROPPED
+static void sync_keyboard_state(KeyboardDevice* keyboard) {
+    unsigned long keystate[BITS_TO_LONGS(KEY_CNT)] = {0};
+
+    keyboard->modifiers = 0;
+    if (ioctl(keyboard->fd, EVIOCGKEY(sizeof(keystate)), keystate) < 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < MODIFIER_KEY_COUNT; i++) {
+        if (test_bit(modifier_keys[i], keystate)) {
+            keyboard->modifiers |= 1 << i;
+        }
+    }
+}
+
+KeyboardDevice* open_keyboard(const char* path) {
+    if (is_mouse_path(path) || find_keyboard(path)) return NULL;
+
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) return NULL;
+
+    unsigned long evbit[BITS_TO_LONGS(EV_CNT)] = {0};
+    unsigned long keybit[BITS_TO_LONGS(KEY_CNT)] = {0};
+    char name[256] = "Unknown";
+
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), evbit) < 0 ||
+        ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybit)), keybit) < 0 ||
+        !test_bit(EV_KEY, evbit) ||
+        !test_bit(KEY_A, keybit) || !test_bit(KEY_LEFTCTRL, keybit)) {
+        close(fd);
+        return NULL;
+    }
+
+    ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+
+    // Our own virtual devices must not count as a held modifier
+    if (strncmp(name, "eeka ", 5) == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // Reuse the slot of an unplugged keyboard before taking a new one
+    KeyboardDevice* keyboard = NULL;
+    for (int i = 0; i < keyboard_count && !keyboard; i++) {
+        if (keyboards[i].fd < 0) keyboard = &keyboards[i];
+    }
+    if (!keyboard && keyboard_count < MAX_KEYBOARDS) {
+        keyboard = &keyboards[keyboard_count++];
+    }
+    if (!keyboard) {
+        close(fd);
+        return NULL;
+    }
+
+    keyboard->fd = fd;
+    snprintf(keyboard->device_path, sizeof(keyboard->device_path), "%s", path);
+    sync_keyboard_state(keyboard);
+    keyboards_open++;
+    update_keyboard_modifiers();
+
+    msg(LOG_NOTICE, "Tracking keyboard modifiers from %s (%s)", path, name);
+    return keyboard;
+}
+
+int init_keyboards(void) {
+    DIR *dir = opendir("/dev/input");
+    if (!dir) {
+        msg(LOG_ERR, "Cannot open /dev/input directory");
+        return 0;
+    }
+
+    struct dirent *entry;
+    keyboard_count = 0;
+    keyboards_open = 0;
+
+    while ((entry = readdir(dir)) != NULL && keyboard_count < MAX_KEYBOARDS) {
+        if (strncmp(entry->d_name, "event", 5) != 0) continue;
+
+        char full_path[280];
+        snprintf(full_path, sizeof(full_path), "/dev/input/%s", entry->d_name);
+        open_keyboard(full_path);
+    }
+
+    closedir(dir);
+
+    if (keyboards_open == 0) {
+        msg(LOG_WARNING, "No readable keyboard device, querying X for modifier state");
+    }
+
+    return keyboards_open;
+}
+
+void cleanup_keyboards(void) {
+    for (int i = 0; i < keyboard_count; i++) {
+        if (keyboards[i].fd >= 0) {
+            close(keyboards[i].fd);
+            keyboards[i].fd = -1;
+        }
+    }
+    keyboard_count = 0;
+    keyboards_open = 0;
+    keyboard_modifiers = 0;
+}
+
+// Unplugged, stop polling it and forget its modifiers
+void close_keyboard(KeyboardDevice* keyboard) {
+    if (keyboard->fd < 0) return;
+
+    close(keyboard->fd);
+    keyboard->fd = -1;
+    keyboard->modifiers = 0;
+    keyboards_open--;
+    update_keyboard_modifiers();
+}
+
+KeyboardDevice* find_keyboard(const char* path) {
+    for (int i = 0; i < keyboard_count; i++) {
+        if (keyboards[i].fd >= 0 && strcmp(keyboards[i].device_path, path) == 0) {
+            return &keyboards[i];
+        }
+    }
+    return NULL;
+}
+
+// After the keyboard went unread for a while: drop what it queued and
+// take the modifiers from the current key state
+void resync_keyboard(KeyboardDevice* keyboard) {
+    if (keyboard->fd < 0) return;
+
+    struct input_event stale[64];
+    while (read(keyboard->fd, stale, sizeof(stale)) > 0);
+    sync_keyboard_state(keyboard);
+    update_keyboard_modifiers();
+}
+
+void process_keyboard_events(KeyboardDevice* keyboard) {
+    struct input_event events[64];
+    ssize_t bytes = read(keyboard->fd, events, sizeof(events));
+
+    if (bytes < 0) {
+        if (errno == ENODEV) {
+            msg(LOG_NOTICE, "Keyboard %s removed", keyboard->device_path);
+            close_keyboard(keyboard);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            msg(LOG_ERR, "Error reading from keyboard %s: %s", keyboard->device_path, strerror(errno));
+        }
+        return;
+    }
+
+    size_t num_events = bytes / sizeof(struct input_event);
+
+    for (size_t i = 0; i < num_events; i++) {
+        struct input_event *ev = &events[i];
+
+        if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+            sync_keyboard_state(keyboard);
+        } else if (ev->type == EV_KEY) {
+            int bit = modifier_bit(ev->code);
+            if (!bit) continue;
+            if (ev->value) {
+                keyboard->modifiers |= bit;
+            } else {
+                keyboard->modifiers &= ~bit;
+            }
+        }
+    }
+
+    update_keyboard_modifiers();
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#define MAX_KEYBOARDS 8
+
+typedef struct {
+    int fd;
+    unsigned int modifiers;
+    char device_path[280];
+} KeyboardDevice;
+
+extern KeyboardDevice keyboards[MAX_KEYBOARDS];
+extern int keyboard_count;
+extern int keyboards_open;
+extern unsigned int keyboard_modifiers;
+
+int             init_keyboards(void);
+void            cleanup_keyboards(void);
+KeyboardDevice* open_keyboard(const char* path);
+void            close_keyboard(KeyboardDevice* keyboard);
+KeyboardDevice* find_keyboard(const char* path);
+void            process_keyboard_events(KeyboardDevice* keyboard);
+void            resync_keyboard(KeyboardDevice* keyboard);
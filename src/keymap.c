@@ -0,0 +1,243 @@
+#include <xcb/xcb_keysyms.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "keymap.h"
+#include "parser.h"
+#include "inject.h"
+#include "eeka.h"
+
+// Keycodes for every keysym used by an action, resolved once when the
+// config is loaded and again only when the server sends MappingNotify.
+// Sorted by keysym so a lookup on the hot path is a binary search.
+//
+// Resolving waits for the server's keyboard mapping, so after startup it
+// is done by the injector thread on its own connection: the loop hands
+// it the keys to resolve and picks the finished table up before its next
+// action, each through a pointer swapped atomically. Until then actions
+// keep using the previous table.
+static KeyMapping* key_mappings = NULL;
+static int key_mapping_count = 0;
+
+static xcb_keycode_t modifier_keycodes[4] = {
+    XCB_KEY_SHIFT_L, XCB_KEY_CONTROL_L, XCB_KEY_ALT_L, XCB_KEY_SUPER_L
+};
+static xcb_keycode_t level3_keycode = 0;
+
+typedef struct {
+    unsigned int* keys;
+    int key_count;
+    KeyMapping* mappings;
+    int count;
+    xcb_keycode_t modifiers[4];
+    xcb_keycode_t level3;
+} KeymapBuild;
+
+static KeymapBuild* build_request = NULL;   // loop thread to injector
+static KeymapBuild* build_result = NULL;    // and back
+
+// Core keymap columns for group 1, in shift level order
+static const int level_columns[] = { 0, 1, 4, 5 };
+
+static int compare_mappings(const void* a, const void* b) {
+    unsigned int ka = ((const KeyMapping*)a)->keysym;
+    unsigned int kb = ((const KeyMapping*)b)->keysym;
+    return (ka > kb) - (ka < kb);
+}
+
+static int resolve_keysym(xcb_key_symbols_t* syms, unsigned int keysym, KeyMapping* mapping) {
+    xcb_keycode_t* codes = xcb_key_symbols_get_keycode(syms, keysym);
+    if (!codes) {
+        return 0;
+    }
+
+    int found = 0;
+    for (xcb_keycode_t* code = codes; *code != XCB_NO_SYMBOL; code++) {
+        for (int level = 0; level < 4; level++) {
+            if (found && level >= mapping->level) break;
+            if (xcb_key_symbols_get_keysym(syms, *code, level_columns[level]) == keysym) {
+                mapping->keycode = *code;
+                mapping->level = level;
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    free(codes);
+    return found;
+}
+
+static xcb_keycode_t resolve_keycode(xcb_key_symbols_t* syms, unsigned int keysym, xcb_keycode_t fallback) {
+    KeyMapping mapping = {0};
+    if (resolve_keysym(syms, keysym, &mapping) && mapping.level == 0) {
+        return mapping.keycode;
+    }
+    return fallback;
+}
+
+static void free_build(KeymapBuild* build) {
+    if (!build) return;
+    free(build->keys);
+    free(build->mappings);
+    free(build);
+}
+
+// The keys of the active config, on the loop thread which owns it
+static KeymapBuild* new_build(void) {
+    KeymapBuild* build = calloc(1, sizeof(*build));
+    int key_count = collect_action_keys(NULL, 0);
+
+    if (build) {
+        build->keys = calloc(key_count > 0 ? key_count : 1, sizeof(*build->keys));
+        build->mappings = calloc(key_count > 0 ? key_count : 1, sizeof(*build->mappings));
+    }
+    if (!build || !build->keys || !build->mappings) {
+        msg(LOG_ERR, "Failed to allocate keycode table");
+        free_build(build);
+        return NULL;
+    }
+
+    build->key_count = collect_action_keys(build->keys, key_count);
+    return build;
+}
+
+static int resolve_build(xcb_connection_t *conn, KeymapBuild* build) {
+    unsigned int* keys = build->keys;
+    int key_count = build->key_count;
+    KeyMapping* mappings = build->mappings;
+
+    xcb_key_symbols_t* syms = xcb_key_symbols_alloc(conn);
+    if (!syms) {
+        msg(LOG_ERR, "Failed to allocate key symbols");
+        return -1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < key_count; i++) {
+        KeyMapping* mapping = &mappings[count];
+        mapping->keysym = keys[i];
+
+        // Letters are parsed upper case but bound without Shift, as in "Ctrl+W"
+        unsigned int lookup = keys[i] < 128 && isupper(keys[i]) ? (unsigned int)tolower(keys[i]) : keys[i];
+
+        if (resolve_keysym(syms, lookup, mapping)) {
+            msg(LOG_DEBUG, "Resolved keysym 0x%x to keycode %u (level %u)",
+                keys[i], mapping->keycode, mapping->level);
+            count++;
+        } else {
+            msg(LOG_ERR, "No keycode found for key: %u", keys[i]);
+        }
+    }
+
+    build->modifiers[0] = resolve_keycode(syms, XK_Shift_L, XCB_KEY_SHIFT_L);
+    build->modifiers[1] = resolve_keycode(syms, XK_Control_L, XCB_KEY_CONTROL_L);
+    build->modifiers[2] = resolve_keycode(syms, XK_Alt_L, XCB_KEY_ALT_L);
+    build->modifiers[3] = resolve_keycode(syms, XK_Super_L, XCB_KEY_SUPER_L);
+    build->level3 = resolve_keycode(syms, XK_ISO_Level3_Shift, 0);
+
+    xcb_key_symbols_free(syms);
+
+    qsort(mappings, count, sizeof(*mappings), compare_mappings);
+    build->count = count;
+
+    msg(LOG_NOTICE, "Resolved %d of %d action keys to keycodes", count, key_count);
+    return count;
+}
+
+static void install_build(KeymapBuild* build) {
+    free(key_mappings);
+    key_mappings = build->mappings;
+    key_mapping_count = build->count;
+    memcpy(modifier_keycodes, build->modifiers, sizeof(modifier_keycodes));
+    level3_keycode = build->level3;
+
+    build->mappings = NULL;
+    free_build(build);
+}
+
+// Waits for the server, only for startup and the bench
+int keymap_build(xcb_connection_t *conn) {
+    KeymapBuild* build = new_build();
+    if (!build) return -1;
+
+    int count = resolve_build(conn, build);
+    if (count < 0) {
+        free_build(build);
+        return -1;
+    }
+    install_build(build);
+    return count;
+}
+
+// A newer request replaces one the injector has not started on
+void keymap_request(void) {
+    KeymapBuild* build = new_build();
+    if (!build) return;
+
+    free_build(__atomic_exchange_n(&build_request, build, __ATOMIC_ACQ_REL));
+    inject_wake();
+}
+
+// On the injector thread, with its own connection
+void keymap_serve(xcb_connection_t *conn) {
+    KeymapBuild* build = __atomic_exchange_n(&build_request, NULL, __ATOMIC_ACQ_REL);
+    if (!build) return;
+
+    if (resolve_build(conn, build) < 0) {
+        free_build(build);
+        return;
+    }
+    free_build(__atomic_exchange_n(&build_result, build, __ATOMIC_ACQ_REL));
+}
+
+// On the loop thread, before the table is used for an action
+void keymap_update(void) {
+    KeymapBuild* build = __atomic_exchange_n(&build_result, NULL, __ATOMIC_ACQ_REL);
+    if (build) {
+        install_build(build);
+    }
+}
+
+void keymap_free(void) {
+    free(key_mappings);
+    key_mappings = NULL;
+    key_mapping_count = 0;
+    free_build(__atomic_exchange_n(&build_request, NULL, __ATOMIC_ACQ_REL));
+    free_build(__atomic_exchange_n(&build_result, NULL, __ATOMIC_ACQ_REL));
+}
+
+const KeyMapping* keymap_lookup(unsigned int keysym) {
+    if (!key_mappings) {
+        return NULL;
+    }
+    KeyMapping key = { .keysym = keysym };
+    return bsearch(&key, key_mappings, key_mapping_count, sizeof(*key_mappings), compare_mappings);
+}
+
+xcb_keycode_t keymap_modifier_keycode(unsigned int modifier) {
+    switch (modifier) {
+        case MOD_SHIFT: return modifier_keycodes[0];
+        case MOD_CTRL:  return modifier_keycodes[1];
+        case MOD_ALT:   return modifier_keycodes[2];
+        case MOD_SUPER: return modifier_keycodes[3];
+        default:        return 0;
+    }
+}
+
+xcb_keycode_t keymap_level3_keycode(void) {
+    return level3_keycode;
+}
+
+void keymap_handle_event(xcb_generic_event_t *event) {
+    if ((event->response_type & ~0x80) != XCB_MAPPING_NOTIFY) {
+        return;
+    }
+
+    xcb_mapping_notify_event_t *ev = (xcb_mapping_notify_event_t *)event;
+    if (ev->request == XCB_MAPPING_KEYBOARD) {
+        msg(LOG_NOTICE, "Keyboard mapping changed, rebuilding keycode table");
+        keymap_request();
+    }
+}
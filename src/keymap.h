@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <xcb/xcb.h>
+
+typedef struct {
+    unsigned int keysym;
+    xcb_keycode_t keycode;
+    uint8_t level;
+} KeyMapping;
+
+int               keymap_build(xcb_connection_t *conn);
+void              keymap_request(void);
+void              keymap_serve(xcb_connection_t *conn);
+void              keymap_update(void);
+void              keymap_free(void);
+const KeyMapping* keymap_lookup(unsigned int keysym);
+xcb_keycode_t     keymap_modifier_keycode(unsigned int modifier);
+xcb_keycode_t     keymap_level3_keycode(void);
+void              keymap_handle_event(xcb_generic_event_t *event);
@@ -0,0 +1,111 @@
+#include <time.h>
+#include <stdio.h>
+
+#include "latency.h"
+#include "eeka.h"
+
+// Fixed bucket histograms for each stage between a mouse event and
+// what eeka does with it. Recording is a clock read and an increment,
+// nothing is allocated; the counts are logged on SIGUSR2.
+//
+// The injector thread records its stage while the loop thread may be
+// dumping, so every counter is updated and read with relaxed atomics.
+// A dump can be a sample or two behind, which does not matter.
+
+uint64_t latency_origin = 0;
+
+typedef struct {
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} Histogram;
+
+static Histogram histograms[LATENCY_STAGES];
+
+static const char* stage_names[LATENCY_STAGES] = {
+    "evdev to read",
+    "window lookup",
+    "evdev to uinput",
+    "evdev to inject",
+};
+
+uint64_t latency_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+uint64_t latency_event_time(const struct input_event* ev) {
+    return (uint64_t)ev->input_event_sec * 1000000000u + (uint64_t)ev->input_event_usec * 1000u;
+}
+
+void latency_record(LatencyStage stage, uint64_t start_ns) {
+    uint64_t now = latency_now();
+    // No origin yet, or a timestamp from another clock
+    if (start_ns == 0 || start_ns > now) return;
+
+    uint64_t ns = now - start_ns;
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+
+    Histogram* h = &histograms[stage];
+    __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->total_ns, ns, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// The count is summed from the buckets so the percentiles add up
+static void snapshot(const Histogram* h, Histogram* copy) {
+    copy->count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        copy->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        copy->count += copy->buckets[i];
+    }
+    copy->total_ns = __atomic_load_n(&h->total_ns, __ATOMIC_RELAXED);
+    copy->max_ns = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+}
+
+// Upper edge of the bucket holding the given fraction of samples
+static uint64_t percentile_us(const Histogram* h, double fraction) {
+    uint64_t wanted = (uint64_t)(h->count * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > wanted) return 1ull << i;
+    }
+    return 1ull << (LATENCY_BUCKETS - 1);
+}
+
+void latency_dump(void) {
+    for (int s = 0; s < LATENCY_STAGES; s++) {
+        Histogram copy;
+        snapshot(&histograms[s], &copy);
+        const Histogram* h = &copy;
+        if (h->count == 0) {
+            msg(LOG_NOTICE, "Latency %-16s no samples", stage_names[s]);
+            continue;
+        }
+
+        msg(LOG_NOTICE, "Latency %-16s n=%llu mean=%llu us p50<%llu us p99<%llu us max=%llu us",
+            stage_names[s], (unsigned long long)h->count,
+            (unsigned long long)(h->total_ns / h->count / 1000),
+            (unsigned long long)percentile_us(h, 0.50),
+            (unsigned long long)percentile_us(h, 0.99),
+            (unsigned long long)(h->max_ns / 1000));
+
+        char line[512];
+        int len = 0;
+        for (int i = 0; i < LATENCY_BUCKETS && len < (int)sizeof(line) - 32; i++) {
+            if (!h->buckets[i]) continue;
+            len += snprintf(line + len, sizeof(line) - len, " <%lluus:%llu",
+                            1ull << i, (unsigned long long)h->buckets[i]);
+        }
+        msg(LOG_NOTICE, "       %-16s%s", "", line);
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <linux/input.h>
+
+// Power of two buckets in microseconds: bucket 0 is below 1 us,
+// bucket n is [2^(n-1), 2^n) us and the last one takes the rest
+#define LATENCY_BUCKETS 24
+
+typedef enum {
+    LATENCY_EVDEV,      // kernel event timestamp to process_evdev_events()
+    LATENCY_LOOKUP,     // window lookup start to result, all its X round trips and parking
+    LATENCY_UINPUT,     // kernel event timestamp to the uinput frame write
+    LATENCY_INJECT,     // kernel event timestamp to the XTest flush or uinput write
+    LATENCY_STAGES
+} LatencyStage;
+
+// Kernel timestamp of the mouse event being handled, CLOCK_MONOTONIC
+// like latency_now() since mouse.c sets EVIOCSCLOCKID. Events of a device
+// that refused it are stamped with the time they were read instead.
+extern uint64_t latency_origin;
+
+uint64_t latency_now(void);
+uint64_t latency_event_time(const struct input_event* ev);
+void     latency_record(LatencyStage stage, uint64_t start_ns);
+void     latency_dump(void);
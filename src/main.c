@@ -1,11 +1,9 @@
 #include <xcb/xcb.h>
-#include <xcb/xcb_keysyms.h>
-#include <xcb/xtest.h>
+#include <xcb/xcbext.h>
 #include <linux/input.h>
-#include <linux/uinput.h>
-#include <dirent.h>
 #include <fcntl.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,8 +20,43 @@
 #include "parser.h"
 #include "eeka.h"
 #include "xdg.h"
-
-static EvdevContext evdev_ctx = {0};
+#include "window.h"
+#include "keyboard.h"
+#include "keymap.h"
+#include "inject.h"
+#include "output.h"
+#include "mouse.h"
+#include "hotplug.h"
+#include "intern.h"
+#include "latency.h"
+#include "record.h"
+#include "realtime.h"
+#include "scroll.h"
+
+#define MAX_EPOLL_EVENTS 16
+
+// How long buffered --record entries and frames the uinput fd refused
+// wait for the loop to go idle before they are written anyway
+#define IDLE_FLUSH_MS 100
+
+// Each fd in the epoll set carries its source and slot index, so a
+// wakeup dispatches straight to the device instead of scanning them all
+enum { SOURCE_X, SOURCE_SIGNAL, SOURCE_KEYBOARD, SOURCE_MOUSE, SOURCE_HOTPLUG };
+
+#define EPOLL_TAG(source, index) (((uint64_t)(source) << 32) | (uint32_t)(index))
+#define EPOLL_SOURCE(tag)        ((uint32_t)((tag) >> 32))
+#define EPOLL_INDEX(tag)         ((uint32_t)(tag))
+
+static int epoll_fd = -1;
+static int signal_fd = -1;
+
+// Returns from epoll_wait(), and those that were timeouts, for SIGUSR2
+// and the bench's idle check
+unsigned long loop_wakeups = 0;
+unsigned long loop_timeouts = 0;
+
+// Milliseconds until held back wheel ticks get a token, or -1
+static int scroll_wait = -1;
 
 xcb_connection_t *connection = NULL;
 xcb_screen_t *screen = NULL;
@@ -35,119 +68,103 @@ int grabbing_enabled = 1;
 int enabled = 1;
 int verbose = 0;
 
-ButtonState button_state = {0};
-
-void handle_signal(int sig);
-void toggle_signal_handler(int sig);
-xcb_window_t get_window_at_pointer(xcb_connection_t *conn);
-xcb_window_t find_target_window(xcb_connection_t *conn);
-WindowClassInfo get_window_class_info(xcb_connection_t *conn, xcb_window_t window);
-void send_key_combination(const Action* action, xcb_window_t target_window);
-int handle_key_binding(int first_button, int second_button);
-void handle_button_press(int button);
-void handle_button_release(int button);
-void handle_scroll_event(int scroll_direction);
+// Toggled off, but events parked for X replies are decided first
+static int disable_pending = 0;
+
+// What became of the mouse event being handled, for --record
+static WindowClassInfo event_window;
+static int event_decision;
+
+// X state the mouse event being handled is decided on: the client window
+// under the pointer and, without evdev keyboards, the keymap. A button or
+// wheel event that needs a reply waits in its mouse's parked queue while
+// motion keeps flowing, and runs once the replies are in. The loop never
+// waits for X itself.
+static WindowTarget event_target;
+static int event_target_ready = 0;
+static int event_modifiers = 0;
+static int event_keymap_ready = 0;
+static MouseDevice* waiting_mouse = NULL;
+static unsigned int waiting_generation = 0;
+static int window_waiting = 0;
+static int keymap_waiting = 0;
+static xcb_query_keymap_cookie_t keymap_cookie;
+
+void send_key_combination(const Action* action, xcb_window_t target_window, int repeat);
+int handle_key_binding(ButtonState* state, int first_button, int second_button);
+void handle_button_press(ButtonState* state, int button);
+void handle_button_release(ButtonState* state, int button);
+void handle_scroll_event(ButtonState* state, int scroll_direction, int ticks);
 void simulate_button_click(int button, xcb_window_t target_window);
+void process_parked_events(void);
+int flush_scroll_actions(void);
 
-void handle_signal(int sig) {
-    msg(LOG_NOTICE, "Received signal %d, shutting down", sig);
-    running = 0;
-}
-
-void toggle_signal_handler(int sig) {
-    (void)sig;
-    enabled = !enabled;
-    msg(LOG_NOTICE, "Toggled enabled state: %s", enabled ? "ON" : "OFF");
-}
-
-xcb_window_t get_window_at_pointer(xcb_connection_t *conn) {
-    xcb_query_pointer_cookie_t cookie = xcb_query_pointer(conn, screen->root);
-    xcb_query_pointer_reply_t *reply = xcb_query_pointer_reply(conn, cookie, NULL);
-    if (!reply) {
-        return XCB_NONE;
+static int watch_fd(int fd, uint32_t source, uint32_t index) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EPOLL_TAG(source, index) };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        msg(LOG_ERR, "Cannot watch fd %d: %s", fd, strerror(errno));
+        return -1;
     }
-    xcb_window_t win = reply->child;
-    free(reply);
-    return win;
+    return 0;
 }
 
-WindowClassInfo get_window_class_info(xcb_connection_t *conn, xcb_window_t window) {
-    
-    WindowClassInfo info = {{0}, {0}, 0};
-
-    xcb_get_property_cookie_t cookie = xcb_get_property(conn, 0, window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, 1024);
-    xcb_get_property_reply_t *reply  = xcb_get_property_reply(conn, cookie, NULL);
-
-    if (reply && reply->type == XCB_ATOM_STRING && reply->format == 8 && reply->length > 0) {
-        
-        char *data = (char *)xcb_get_property_value(reply);
-        int len = xcb_get_property_value_length(reply);
-
-        if (len > 0) {
-            char *instance = data;
-            char *class_name = NULL;
-            for (int i = 0; i < len - 1; i++) {
-                if (data[i] == '\0') {
-                    class_name = &data[i + 1];
-                    break;
-                }
-            }
-
-            if (instance) 
-                strncpy(info.instance, instance, sizeof(info.instance) - 1);
-            if (class_name)
-                strncpy(info.class_name, class_name, sizeof(info.class_name) - 1);
-
-            info.valid = 1;
-        }
-    }
-
-    if (reply) free(reply);
-    return info;
+// Toggled off, mice are left to X and no device is polled
+static void watch_mouse(MouseDevice* mouse) {
+    if (!enabled) return;
+    watch_fd(mouse->fd, SOURCE_MOUSE, mouse - mice);
 }
 
-xcb_window_t find_target_window(xcb_connection_t *conn) {
-
-    xcb_window_t window = get_window_at_pointer(conn);
+static void watch_keyboard(KeyboardDevice* keyboard) {
+    if (!enabled) return;
+    watch_fd(keyboard->fd, SOURCE_KEYBOARD, keyboard - keyboards);
+}
 
-    if (window == XCB_NONE || window == screen->root) {
-        return XCB_NONE;
-    }
+static const HotplugHandlers hotplug_handlers = { watch_mouse, watch_keyboard };
 
-    xcb_query_tree_cookie_t tree_cookie = xcb_query_tree(conn, window);
-    xcb_query_tree_reply_t *tree_reply = xcb_query_tree_reply(conn, tree_cookie, NULL);
+// Parse into a new snapshot; the old one stays active if that fails
+static void reload_config(const char* config_path) {
+    msg(LOG_NOTICE, "Reloading configuration");
 
-    if (tree_reply && tree_reply->children_len > 0) {
-        xcb_window_t *children = xcb_query_tree_children(tree_reply);
-        window = children[0];
-    }  else if (tree_reply && tree_reply->children_len == 0) {
-        msg(LOG_DEBUG, "No child windows found for %u, using it as target", window);
+    if (parse_config_file(config_path) < 0) {
+        msg(LOG_ERR, "Reload failed, keeping the previous configuration");
+        return;
     }
 
-    WindowClassInfo info = get_window_class_info(conn, window);
-    msg(LOG_DEBUG, "Target window found: %u (instance='%s', class='%s')",
-                window, info.instance, info.class_name);
-    
-    if (tree_reply) free(tree_reply);
-    return window;
+    // Ticks still waiting belong to bindings of the old snapshot
+    scroll_reset();
+    keymap_request();
+    refresh_mice(watch_mouse);
 }
 
 #define SEND_KEY_PRESS(keycode, target) \
-    xcb_test_fake_input(connection, XCB_KEY_PRESS, keycode, XCB_CURRENT_TIME, target, 0, 0, 0)
+    steps[step_count++] = (InjectStep){ XCB_KEY_PRESS, keycode, target, 0, 0, 0 }
 
 #define SEND_KEY_RELEASE(keycode, target) \
-    xcb_test_fake_input(connection, XCB_KEY_RELEASE, keycode, XCB_CURRENT_TIME, target, 0, 0, 0)
+    steps[step_count++] = (InjectStep){ XCB_KEY_RELEASE, keycode, target, 0, 0, 0 }
+
+// Gap after the last queued step, released by the injector timer
+#define WAIT_US(us) \
+    steps[step_count - 1].delay_us = (us)
+
+// The window the current event is decided on. prepare_event() looks it
+// up before any event that needs it runs; should one slip through, it is
+// decided as over no window rather than by waiting on X here.
+static const WindowTarget* event_target_window(void) {
+    if (!event_target_ready) {
+        msg(LOG_DEBUG, "Window under the pointer was not looked up for this event");
+        event_target = (WindowTarget){ XCB_NONE, {0, 0, 0} };
+        event_target_ready = 1;
+    }
+    return &event_target;
+}
 
-int handle_key_binding(int first_button, int second_button) {
-    xcb_window_t target_window = find_target_window(connection);
-    WindowClassInfo info = {{0}, {0}, 0};
+// The binding for the buttons in the window under the pointer, if any
+static const Action* find_binding(int first_button, int second_button) {
+    WindowClassInfo info = event_target_window()->info;
     const Action* action = NULL;
 
-    if (target_window != XCB_NONE) {
-        info = get_window_class_info(connection, target_window);
-    }
-    
     if (info.valid) {
+        event_window = info;
         action = get_action_for_window(info.instance, info.class_name, first_button, second_button);
     } else {
         action = get_action_for_buttons(first_button, second_button);
@@ -156,77 +173,96 @@ int handle_key_binding(int first_button, int second_button) {
     if (action) {
         msg(LOG_DEBUG, "Found binding for button %d + %d: %s",
                     first_button, second_button, get_action_name(action));
-
-        grabbing_enabled = 0;
-        send_key_combination(action, target_window);
-        grabbing_enabled = 1;
-        button_state.combo_used = 1;
-        return 1;
     } else {
         msg(LOG_DEBUG, "No binding found for buttons %d + %d",
                   first_button, second_button);
-        return 0;
     }
+    return action;
+}
+
+int handle_key_binding(ButtonState* state, int first_button, int second_button) {
+    const Action* action = find_binding(first_button, second_button);
+    if (!action) return 0;
+
+    grabbing_enabled = 0;
+    send_key_combination(action, event_target.window, 1);
+    grabbing_enabled = 1;
+    event_decision |= RECORD_ACTION;
+    state->combo_used = 1;
+    return 1;
 }
 
-void send_key_combination(const Action* action, xcb_window_t target_window) {
+// Sends the key repeat times within one action, the modifiers stay held
+void send_key_combination(const Action* action, xcb_window_t target_window, int repeat) {
     msg(LOG_DEBUG, "Sending key combination: %s", get_action_name(action));
+    keymap_update();
     
     if (target_window == XCB_NONE) {
         msg(LOG_DEBUG, "No valid target window found or window is blacklisted");
         return;
     }
 
-    xcb_keycode_t key_code = 0;
-    xcb_key_symbols_t* key_symbols = xcb_key_symbols_alloc(connection);
+    const KeyMapping* mapping = keymap_lookup(action->key);
 
-    if (!key_symbols) {
-        msg(LOG_ERR, "Failed to allocate key symbols");
-        return;
-    }
-
-    xcb_keycode_t* key_codes = xcb_key_symbols_get_keycode(key_symbols, action->key);
-
-    if (key_codes) {
-        key_code = key_codes[0];
-        free(key_codes);
-    } else {
+    if (!mapping) {
         msg(LOG_ERR, "No keycode found for key: %u", (unsigned int)action->key);
-        xcb_key_symbols_free(key_symbols);
         return;
     }
 
-    xcb_key_symbols_free(key_symbols);
-    
-    xcb_set_input_focus(connection, XCB_INPUT_FOCUS_POINTER_ROOT, target_window, XCB_CURRENT_TIME);
-    xcb_flush(connection);
-
-    usleep(1000); // 1ms delay
+    xcb_keycode_t key_code = mapping->keycode;
+    unsigned int modifiers = action->modifiers;
+    xcb_keycode_t level3 = 0;
+
+    // Symbols on a shifted level need Shift (and AltGr) held to come out right
+    if (mapping->level & 1)
+        modifiers |= MOD_SHIFT;
+    if (mapping->level >= 2)
+        level3 = keymap_level3_keycode();
+
+    InjectStep steps[INJECT_ACTION_STEPS];
+    int step_count = 0;
+
+    // An unknown active window (no EWMH) is treated as a different one
+    FocusPolicy policy = get_focus_policy();
+    if (policy == FOCUS_ALWAYS || (policy == FOCUS_CHANGE && get_active_window() != target_window)) {
+        steps[step_count++] = (InjectStep){ INJECT_FOCUS, 0, target_window, 0, 0, 0 };
+        WAIT_US(1000); // 1ms delay
+        set_active_window(target_window);
+    }
 
-    if (action->modifiers & MOD_CTRL)
-        SEND_KEY_PRESS(XCB_KEY_CONTROL_L, target_window);
-    if (action->modifiers & MOD_SHIFT)
-        SEND_KEY_PRESS(XCB_KEY_SHIFT_L, target_window);
-    if (action->modifiers & MOD_ALT)
-        SEND_KEY_PRESS(XCB_KEY_ALT_L, target_window);
-    if (action->modifiers & MOD_SUPER)
-        SEND_KEY_PRESS(XCB_KEY_SUPER_L, target_window);
+    if (modifiers & MOD_CTRL)
+        SEND_KEY_PRESS(keymap_modifier_keycode(MOD_CTRL), target_window);
+    if (modifiers & MOD_SHIFT)
+        SEND_KEY_PRESS(keymap_modifier_keycode(MOD_SHIFT), target_window);
+    if (modifiers & MOD_ALT)
+        SEND_KEY_PRESS(keymap_modifier_keycode(MOD_ALT), target_window);
+    if (modifiers & MOD_SUPER)
+        SEND_KEY_PRESS(keymap_modifier_keycode(MOD_SUPER), target_window);
+    if (level3)
+        SEND_KEY_PRESS(level3, target_window);
+
+    for (int i = 0; i < repeat; i++) {
+        // The virtual keyboard sends the whole chord in one write
+        if (i > 0 && inject_backend == INJECT_XTEST)
+            WAIT_US(1000);
+        SEND_KEY_PRESS(key_code, target_window);
+        if (inject_backend == INJECT_XTEST)
+            WAIT_US(1000);
+        SEND_KEY_RELEASE(key_code, target_window);
+    }
 
-    SEND_KEY_PRESS(key_code, target_window);
-    xcb_flush(connection);
-    usleep(1000);
-    SEND_KEY_RELEASE(key_code, target_window);
-
-    if (action->modifiers & MOD_SUPER)
-        SEND_KEY_RELEASE(XCB_KEY_SUPER_L, target_window);
-    if (action->modifiers & MOD_ALT)
-        SEND_KEY_RELEASE(XCB_KEY_ALT_L, target_window);
-    if (action->modifiers & MOD_SHIFT)
-        SEND_KEY_RELEASE(XCB_KEY_SHIFT_L, target_window);
-    if (action->modifiers & MOD_CTRL)
-        SEND_KEY_RELEASE(XCB_KEY_CONTROL_L, target_window);
+    if (level3)
+        SEND_KEY_RELEASE(level3, target_window);
+    if (modifiers & MOD_SUPER)
+        SEND_KEY_RELEASE(keymap_modifier_keycode(MOD_SUPER), target_window);
+    if (modifiers & MOD_ALT)
+        SEND_KEY_RELEASE(keymap_modifier_keycode(MOD_ALT), target_window);
+    if (modifiers & MOD_SHIFT)
+        SEND_KEY_RELEASE(keymap_modifier_keycode(MOD_SHIFT), target_window);
+    if (modifiers & MOD_CTRL)
+        SEND_KEY_RELEASE(keymap_modifier_keycode(MOD_CTRL), target_window);
         
-    xcb_flush(connection);
+    inject_push(steps, step_count);
 }
 
 int toggle_eeka_daemon(void) {
@@ -272,134 +308,14 @@ void print_usage(const char *progname) {
            "  -h, --help              Display this help message\n"
            "  -c, --config <file>     Specify configuration file\n"
            "  -V, --verbose           Enable verbose logging\n"
-           "  -t, --toggle            Enable/Disable all button grabs globally\n",
+           "  -t, --toggle            Enable/Disable all button grabs globally\n"
+           "  -r, --record <file>     Append every mouse event and its outcome to a trace\n"
+           "  -i, --inject <backend>  Send shortcuts with xtest (default) or uinput\n"
+           "  -R, --realtime[=<cpu>]  Run at real-time priority with locked memory,\n"
+           "                          pinned to the given CPU\n",
            progname);
 }
 
-#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
-#define BITS_PER_LONG (sizeof(long) * 8)
-#define test_bit(nr, addr) (((1UL << ((nr) % BITS_PER_LONG)) & ((addr)[(nr) / BITS_PER_LONG])) != 0)
-
-// Find mouse device function
-int find_mouse_device(char *device_path, size_t path_size) {
-    DIR *dir = opendir("/dev/input");
-    if (!dir) {
-        msg(LOG_ERR, "Cannot open /dev/input directory");
-        return -1; 
-    }
-    
-    struct dirent *entry;
-    char best_device[280] = {0};
-    int best_score = 0;
-    
-    while ((entry = readdir(dir)) != NULL) {
-        if (strncmp(entry->d_name, "event", 5) != 0) continue;
-        
-        char full_path[280];
-        snprintf(full_path, sizeof(full_path), "/dev/input/%s", entry->d_name);
-        
-        int fd = open(full_path, O_RDONLY);
-        if (fd < 0) continue;
-        
-        unsigned long evbit[BITS_TO_LONGS(EV_CNT)] = {0};
-        unsigned long keybit[BITS_TO_LONGS(KEY_CNT)] = {0};
-        unsigned long relbit[BITS_TO_LONGS(REL_CNT)] = {0};
-        
-        if (ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), evbit) >= 0 &&
-            ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybit)), keybit) >= 0 &&
-            ioctl(fd, EVIOCGBIT(EV_REL, sizeof(relbit)), relbit) >= 0) {
-            
-            if (test_bit(EV_KEY, evbit) && test_bit(EV_REL, evbit) &&
-                test_bit(BTN_LEFT, keybit) && test_bit(BTN_RIGHT, keybit) &&
-                test_bit(REL_X, relbit) && test_bit(REL_Y, relbit)) {
-                
-                char name[256] = "Unknown";
-                ioctl(fd, EVIOCGNAME(sizeof(name)), name);
-                
-                int score = 0;
-                
-                if (is_device_blacklisted(name)) {
-                    msg(LOG_DEBUG, "Skipping blacklisted device: %s (%s)", full_path, name);
-                    close(fd);
-                    continue;
-                }
-                
-
-                
-                if (strstr(name, "Mouse") || strstr(name, "mouse")) {
-                    score += 10;
-                }
-                
-                if (test_bit(REL_WHEEL, relbit)) {
-                    score += 5;
-                }
-                
-                if (test_bit(BTN_SIDE, keybit) || test_bit(BTN_EXTRA, keybit)) {
-                    score += 3;
-                }
-                
-                msg(LOG_DEBUG, "Found mouse candidate: %s (%s) score=%d", full_path, name, score);
-                
-                if (score > best_score) {
-                    best_score = score;
-                    strncpy(best_device, full_path, sizeof(best_device) - 1);
-                    best_device[sizeof(best_device) - 1] = '\0';
-                }
-            }
-        }
-        close(fd);
-    }
-    
-    closedir(dir);
-    
-    if (best_score > 0) {
-        char name[256] = "Unknown";
-        int fd = open(best_device, O_RDONLY);
-        if (fd >= 0) {
-            ioctl(fd, EVIOCGNAME(sizeof(name)), name);
-            close(fd);
-        }
-        
-        msg(LOG_NOTICE, "Selected mouse device: %s (%s)", best_device, name);
-        strncpy(device_path, best_device, path_size - 1);
-        device_path[path_size - 1] = '\0';
-        return 0;
-    }
-    
-    msg(LOG_ERR, "No suitable mouse device found");
-    return -1;
-}
-
-int init_evdev(void) {
-    if (find_mouse_device(evdev_ctx.device_path, sizeof(evdev_ctx.device_path)) < 0) {
-        return -1;
-    }
-    
-    evdev_ctx.mouse_fd = open(evdev_ctx.device_path, O_RDONLY | O_NONBLOCK);
-    if (evdev_ctx.mouse_fd < 0) {
-        msg(LOG_ERR, "Cannot open mouse device %s: %s", evdev_ctx.device_path, strerror(errno));
-        return -1;
-    }
-    
-    // Grab exclusive access to prevent events reaching other applications
-    if (ioctl(evdev_ctx.mouse_fd, EVIOCGRAB, 1) < 0) {
-        msg(LOG_ERR, "Cannot grab exclusive access to %s: %s", evdev_ctx.device_path, strerror(errno));
-        close(evdev_ctx.mouse_fd);
-        return -1;
-    }
-    
-    msg(LOG_NOTICE, "Grabbed exclusive access to %s", evdev_ctx.device_path);
-    return 0;
-}
-
-void cleanup_evdev(void) {
-    if (evdev_ctx.mouse_fd >= 0) {
-        ioctl(evdev_ctx.mouse_fd, EVIOCGRAB, 0);  // Release grab
-        close(evdev_ctx.mouse_fd);
-        evdev_ctx.mouse_fd = -1;
-    }
-}
-
 int evdev_button_to_eeka_button(uint32_t button) {
     switch (button) {
         case BTN_LEFT:    return 1;        // LBUTTON
@@ -415,80 +331,20 @@ int evdev_button_to_eeka_button(uint32_t button) {
     }
 }
 
-int uinput_fd = -1;
-
-int init_uinput(void) {
-    uinput_fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-    if (uinput_fd < 0) {
-        msg(LOG_ERR, "Cannot open /dev/uinput: %s", strerror(errno));
-        return -1;
-    }
-    
-    // Enable event types
-    ioctl(uinput_fd, UI_SET_EVBIT, EV_KEY);
-    ioctl(uinput_fd, UI_SET_EVBIT, EV_REL);
-    ioctl(uinput_fd, UI_SET_EVBIT, EV_SYN);
-    
-    // Enable mouse buttons
-    ioctl(uinput_fd, UI_SET_KEYBIT, BTN_LEFT);
-    ioctl(uinput_fd, UI_SET_KEYBIT, BTN_RIGHT);
-    ioctl(uinput_fd, UI_SET_KEYBIT, BTN_MIDDLE);
-    ioctl(uinput_fd, UI_SET_KEYBIT, BTN_SIDE);
-    ioctl(uinput_fd, UI_SET_KEYBIT, BTN_EXTRA);
-    
-    // Enable mouse movement
-    ioctl(uinput_fd, UI_SET_RELBIT, REL_X);
-    ioctl(uinput_fd, UI_SET_RELBIT, REL_Y);
-    ioctl(uinput_fd, UI_SET_RELBIT, REL_WHEEL);
-    
-    struct uinput_user_dev udev = {0};
-    strcpy(udev.name, "eeka virtual mouse");
-    udev.id.bustype = BUS_USB;
-    udev.id.vendor = 0x1234;
-    udev.id.product = 0x5678;
-    udev.id.version = 1;
-    
-    write(uinput_fd, &udev, sizeof(udev));
-    ioctl(uinput_fd, UI_DEV_CREATE);
-    
-    msg(LOG_NOTICE, "Created virtual mouse device");
-    return 0;
-}
-
-void cleanup_uinput(void) {
-    if (uinput_fd >= 0) {
-        ioctl(uinput_fd, UI_DEV_DESTROY);
-        close(uinput_fd);
-        uinput_fd = -1;
-    }
+void forward_event(MouseDevice* mouse, const struct input_event *ev) {
+    output_event(&mouse->output, ev);
+    event_decision |= RECORD_FORWARDED;
 }
 
-void forward_event(int type, int code, int value) {
-    if (uinput_fd < 0) return;
-    
-    struct input_event ev = {0};
-    ev.type = type;
-    ev.code = code;
-    ev.value = value;
-    gettimeofday(&ev.time, NULL);
-    
-    write(uinput_fd, &ev, sizeof(ev));
-    
-    // Send sync event
-    ev.type = EV_SYN;
-    ev.code = SYN_REPORT;
-    ev.value = 0;
-    write(uinput_fd, &ev, sizeof(ev));
-}
-
-void handle_button_press(int button) {
+void handle_button_press(ButtonState* state, int button) {
     msg(LOG_DEBUG, "%s pressed", get_button_name(button));
     
-    if (!button_state.modifier_pressed && 
+    if (!state->modifier_pressed && 
         (button == RBUTTON || button == BBUTTON || button == FBUTTON)) {
         
-        xcb_window_t target_window = find_target_window(connection);
-        WindowClassInfo info = get_window_class_info(connection, target_window);
+        const WindowTarget* target = event_target_window();
+        xcb_window_t target_window = target->window;
+        WindowClassInfo info = target->info;
         
         if (info.valid && is_button_blacklisted(info.instance, info.class_name, button)) {
             msg(LOG_DEBUG, "Button %d pressed on blacklisted window - this shouldn't happen", button);
@@ -500,92 +356,111 @@ void handle_button_press(int button) {
             return;
         }
         
-        if (button_state.blocked_count < 10) {
-            button_state.blocked_buttons[button_state.blocked_count++] = button;
+        if (state->blocked_count < 10) {
+            state->blocked_buttons[state->blocked_count++] = button;
         }
         
-        button_state.modifier_pressed = button;
-        button_state.combo_used = 0;
+        state->modifier_pressed = button;
+        state->combo_used = 0;
         msg(LOG_DEBUG, "Button %d set as potential modifier - blocking original click", button);
         return;
     }
 
-    if (button == LBUTTON && !button_state.modifier_pressed) {
-        button_state.modifier_pressed = button;
-        button_state.combo_used = 0;
+    if (button == LBUTTON && !state->modifier_pressed) {
+        state->modifier_pressed = button;
+        state->combo_used = 0;
         msg(LOG_DEBUG, "LButton set as potential modifier - allowing passthrough");
         return;
     }
 
-    if (button_state.modifier_pressed && button != button_state.modifier_pressed) {
-        msg(LOG_DEBUG, "Detected combo: Button%d + Button%d", button_state.modifier_pressed, button);
-        handle_key_binding(button_state.modifier_pressed, button);
+    if (state->modifier_pressed && button != state->modifier_pressed) {
+        msg(LOG_DEBUG, "Detected combo: Button%d + Button%d", state->modifier_pressed, button);
+        handle_key_binding(state, state->modifier_pressed, button);
         return;
     }
 }
 
-int was_button_blocked(int button) {
-    for (int i = 0; i < button_state.blocked_count; i++) {
-        if (button_state.blocked_buttons[i] == button) {
+int was_button_blocked(ButtonState* state, int button) {
+    for (int i = 0; i < state->blocked_count; i++) {
+        if (state->blocked_buttons[i] == button) {
             return 1;
         }
     }
     return 0;
 }
 
-void remove_from_blocked_list(int button) {
-    for (int i = 0; i < button_state.blocked_count; i++) {
-        if (button_state.blocked_buttons[i] == button) {
+void remove_from_blocked_list(ButtonState* state, int button) {
+    for (int i = 0; i < state->blocked_count; i++) {
+        if (state->blocked_buttons[i] == button) {
             // Shift remaining buttons down
-            for (int j = i; j < button_state.blocked_count - 1; j++) {
-                button_state.blocked_buttons[j] = button_state.blocked_buttons[j + 1];
+            for (int j = i; j < state->blocked_count - 1; j++) {
+                state->blocked_buttons[j] = state->blocked_buttons[j + 1];
             }
-            button_state.blocked_count--;
+            state->blocked_count--;
             break;
         }
     }
 }
 
-void handle_button_release(int button) {
+void handle_button_release(ButtonState* state, int button) {
     msg(LOG_DEBUG, "Button%d released", button);
     
-    if (button_state.modifier_pressed == button && was_button_blocked(button)) {
+    if (state->modifier_pressed == button && was_button_blocked(state, button)) {
         if (button == LBUTTON) {
             msg(LOG_DEBUG, "LButton modifier released - no action needed");
-        } else if (!button_state.combo_used && 
+        } else if (!state->combo_used && 
                    (button == RBUTTON || button == BBUTTON || button == FBUTTON)) {
-            if (handle_key_binding(button, 0)) {
+            if (handle_key_binding(state, button, 0)) {
                 msg(LOG_DEBUG, "Found standalone mapping for Button%d", button);
             } else {
                 msg(LOG_DEBUG, "No mapping for Button%d - simulating original click", button);
-                simulate_button_click(button, find_target_window(connection));
+                simulate_button_click(button, event_target_window()->window);
             }
         }
         
-        remove_from_blocked_list(button);
-        button_state.modifier_pressed = 0;
-        button_state.combo_used = 0;
-    } else if (was_button_blocked(button)) {
+        remove_from_blocked_list(state, button);
+        state->modifier_pressed = 0;
+        state->combo_used = 0;
+    } else if (was_button_blocked(state, button)) {
         msg(LOG_DEBUG, "Button %d release (non modifier) - was blocked, removing from blocked list", button);
-        remove_from_blocked_list(button);
+        remove_from_blocked_list(state, button);
     } else {
-        if (button_state.modifier_pressed == button) {
-            button_state.modifier_pressed = 0;
-            button_state.combo_used = 0;
+        if (state->modifier_pressed == button) {
+            state->modifier_pressed = 0;
+            state->combo_used = 0;
         }
         msg(LOG_DEBUG, "Button %d release - was not blocked, ignoring", button);
     }
 }
 
-void handle_scroll_event(int scroll_direction) {
-    if (button_state.modifier_pressed) {
+// Wheel ticks collect on their binding, flush_scroll_actions() sends them
+void handle_scroll_event(ButtonState* state, int scroll_direction, int ticks) {
+    const Action* action;
+    if (state->modifier_pressed) {
         msg(LOG_DEBUG, "Detected combo: Button%d + %s", 
-            button_state.modifier_pressed, 
-            scroll_direction == SCROLL_UP ? "ScrollUp" : "ScrollDown");
-        handle_key_binding(button_state.modifier_pressed, scroll_direction);
+            state->modifier_pressed, get_button_name(scroll_direction));
+        action = find_binding(state->modifier_pressed, scroll_direction);
     } else {
-        handle_key_binding(scroll_direction, 0);
+        action = find_binding(scroll_direction, 0);
+    }
+    if (!action) return;
+
+    if (!scroll_add(action, event_target.window, ticks, latency_origin)) {
+        send_key_combination(action, event_target.window, ticks < SCROLL_REPEAT_MAX ? ticks : SCROLL_REPEAT_MAX);
     }
+    event_decision |= RECORD_ACTION;
+    state->combo_used = 1;
+}
+
+static void send_scroll_action(const Action* action, xcb_window_t window, int repeat, uint64_t origin) {
+    latency_origin = origin;
+    send_key_combination(action, window, repeat);
+}
+
+// Sends the wheel actions their token buckets allow; returns the
+// milliseconds until held back ticks can go, or -1
+int flush_scroll_actions(void) {
+    return scroll_flush(send_scroll_action);
 }
 
 void simulate_button_click(int button, xcb_window_t target_window) {
@@ -605,63 +480,50 @@ void simulate_button_click(int button, xcb_window_t target_window) {
             return;
     }
     
-    xcb_query_pointer_cookie_t cookie = xcb_query_pointer(connection, target_window);
-    xcb_query_pointer_reply_t *reply = xcb_query_pointer_reply(connection, cookie, NULL);
-    
-    if (!reply) {
-        msg(LOG_DEBUG, "Failed to get pointer position for click simulation");
-        return;
-    }
-    
-    int16_t x = reply->win_x;
-    int16_t y = reply->win_y;
-    free(reply);
-    
-    xcb_test_fake_input(connection, XCB_BUTTON_PRESS, xcb_button, XCB_CURRENT_TIME, target_window, x, y, 0);
-    xcb_flush(connection);
-    usleep(10000);
-    xcb_test_fake_input(connection, XCB_BUTTON_RELEASE, xcb_button, XCB_CURRENT_TIME, target_window, x, y, 0);
-    xcb_flush(connection);
+    // XTest presses buttons wherever the pointer is, the position is not
+    // part of the request
+    InjectStep steps[] = {
+        { XCB_BUTTON_PRESS, xcb_button, target_window, 0, 0, 10000 },
+        { XCB_BUTTON_RELEASE, xcb_button, target_window, 0, 0, 0 },
+    };
+    inject_push(steps, 2);
     
-    msg(LOG_DEBUG, "Simulated click for button %d at (%d, %d)", button, x, y);
+    msg(LOG_DEBUG, "Simulated click for button %d", button);
 }
 
-void add_to_blacklisted_list(int button) {
-    for (int i = 0; i < button_state.blacklisted_count; i++) {
-        if (button_state.blacklisted_buttons[i] == button) {
+void add_to_blacklisted_list(ButtonState* state, int button) {
+    for (int i = 0; i < state->blacklisted_count; i++) {
+        if (state->blacklisted_buttons[i] == button) {
             return;
         }
     }
-    if (button_state.blacklisted_count < 10) {
-        button_state.blacklisted_buttons[button_state.blacklisted_count++] = button;
+    if (state->blacklisted_count < 10) {
+        state->blacklisted_buttons[state->blacklisted_count++] = button;
     }
 }
 
-void remove_from_blacklisted_list(int button) {
-    for (int i = 0; i < button_state.blacklisted_count; i++) {
-        if (button_state.blacklisted_buttons[i] == button) {
-            for (int j = i; j < button_state.blacklisted_count - 1; j++) {
-                button_state.blacklisted_buttons[j] = button_state.blacklisted_buttons[j + 1];
+void remove_from_blacklisted_list(ButtonState* state, int button) {
+    for (int i = 0; i < state->blacklisted_count; i++) {
+        if (state->blacklisted_buttons[i] == button) {
+            for (int j = i; j < state->blacklisted_count - 1; j++) {
+                state->blacklisted_buttons[j] = state->blacklisted_buttons[j + 1];
             }
-            button_state.blacklisted_count--;
+            state->blacklisted_count--;
             break;
         }
     }
 }
 
-int is_currently_blacklisted(int button) {
-    for (int i = 0; i < button_state.blacklisted_count; i++) {
-        if (button_state.blacklisted_buttons[i] == button) {
+int is_currently_blacklisted(ButtonState* state, int button) {
+    for (int i = 0; i < state->blacklisted_count; i++) {
+        if (state->blacklisted_buttons[i] == button) {
             return 1;
         }
     }
     return 0;
 }
 
-int are_keyboard_modifiers_pressed(void) {
-    xcb_query_keymap_cookie_t cookie = xcb_query_keymap(connection);
-    xcb_query_keymap_reply_t *reply = xcb_query_keymap_reply(connection, cookie, NULL);
-    
+static int keymap_modifiers_held(const xcb_query_keymap_reply_t *reply) {
     if (!reply) {
         return 0;
     }
@@ -690,109 +552,611 @@ int are_keyboard_modifiers_pressed(void) {
         }
     }
     
-    free(reply);
     return modifiers_pressed;
 }
 
-void process_evdev_events(void) {
-    struct input_event events[64];
-    ssize_t bytes = read(evdev_ctx.mouse_fd, events, sizeof(events));
-    
-    if (bytes < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            msg(LOG_ERR, "Error reading from mouse device: %s", strerror(errno));
+int are_keyboard_modifiers_pressed(void) {
+    if (keyboards_open > 0) {
+        if (keyboard_modifiers) {
+            msg(LOG_DEBUG, "Keyboard modifier detected (mask 0x%x)", keyboard_modifiers);
         }
+        return keyboard_modifiers != 0;
+    }
+
+    // Queried by prepare_event() for every event that gets here
+    if (!event_keymap_ready) {
+        msg(LOG_DEBUG, "Keymap was not queried for this event, assuming no modifier held");
+        return 0;
+    }
+    return event_modifiers;
+}
+
+static int is_wheel_axis(uint16_t code) {
+    return code == REL_WHEEL || code == REL_HWHEEL ||
+           code == REL_WHEEL_HI_RES || code == REL_HWHEEL_HI_RES;
+}
+
+// One event from a grabbed mouse: run it through the state machine
+// and forward it unless it was consumed
+static void process_evdev_event(MouseDevice* mouse, struct input_event *ev) {
+    ButtonState* state = &mouse->button_state;
+
+    if (!enabled || !grabbing_enabled) {
+        forward_event(mouse, ev);
         return;
     }
     
-    size_t num_events = bytes / sizeof(struct input_event);
-    
-    for (size_t i = 0; i < num_events; i++) {
-        struct input_event *ev = &events[i];
+    if (ev->type == EV_KEY) {
+        int eeka_button = evdev_button_to_eeka_button(ev->code);
+        int should_block = 0;
+        int is_blacklisted = 0;
         
-        if (!enabled || !grabbing_enabled) {
-            forward_event(ev->type, ev->code, ev->value);
-            continue;
+        if (eeka_button == RBUTTON || eeka_button == BBUTTON || eeka_button == FBUTTON || eeka_button == LBUTTON) {
+            if (are_keyboard_modifiers_pressed()) {
+                msg(LOG_DEBUG, "Keyboard modifiers detected - passing button %d through", eeka_button);
+                forward_event(mouse, ev);
+                return;
+            }
         }
         
-        if (ev->type == EV_KEY) {
-            int eeka_button = evdev_button_to_eeka_button(ev->code);
-            int should_block = 0;
-            int is_blacklisted = 0;
-            
-            if (eeka_button == RBUTTON || eeka_button == BBUTTON || eeka_button == FBUTTON || eeka_button == LBUTTON) {
-                if (are_keyboard_modifiers_pressed()) {
-                    msg(LOG_DEBUG, "Keyboard modifiers detected - passing button %d through", eeka_button);
-                    forward_event(ev->type, ev->code, ev->value);
-                    continue;
-                }
-            }
-            
-            if (ev->value == 1) { // PRESS
-                if (eeka_button == RBUTTON || eeka_button == BBUTTON || eeka_button == FBUTTON) {
-                    xcb_window_t target_window = find_target_window(connection);
-                    WindowClassInfo info = get_window_class_info(connection, target_window);
-                    
-                    if (info.valid && is_button_blacklisted(info.instance, info.class_name, eeka_button)) {
-                        is_blacklisted = 1;
-                        add_to_blacklisted_list(eeka_button);
-                        msg(LOG_DEBUG, "Button %d on blacklisted window - passing through completely", eeka_button);
-                    } else {
-                        should_block = 1;
-                    }
-                }
+        if (ev->value == 1) { // PRESS
+            if (eeka_button == RBUTTON || eeka_button == BBUTTON || eeka_button == FBUTTON) {
+                WindowClassInfo info = event_target_window()->info;
+                event_window = info;
                 
-                if (!is_blacklisted) {
-                    handle_button_press(eeka_button);
-                }
-                
-            } else if (ev->value == 0) { // RELEASE
-                if (is_currently_blacklisted(eeka_button)) {
+                if (info.valid && is_button_blacklisted(info.instance, info.class_name, eeka_button)) {
                     is_blacklisted = 1;
-                    remove_from_blacklisted_list(eeka_button);
-                    msg(LOG_DEBUG, "Button %d release - was blacklisted, passing through", eeka_button);
+                    add_to_blacklisted_list(state, eeka_button);
+                    msg(LOG_DEBUG, "Button %d on blacklisted window - passing through completely", eeka_button);
                 } else {
-
-                    if (was_button_blocked(eeka_button)) {
-                        should_block = 1;
-                    }
-                    handle_button_release(eeka_button);
+                    should_block = 1;
                 }
             }
             
-            if (!should_block) {
-                forward_event(ev->type, ev->code, ev->value);
+            if (!is_blacklisted) {
+                handle_button_press(state, eeka_button);
             }
             
-        } else if (ev->type == EV_REL && ev->code == REL_WHEEL) {
-            int should_block = 0;
-            
-            if (are_keyboard_modifiers_pressed()) {
-                msg(LOG_DEBUG, "Keyboard modifiers detected - passing scroll through");
-                forward_event(ev->type, ev->code, ev->value);
-                continue;
+        } else if (ev->value == 0) { // RELEASE
+            if (is_currently_blacklisted(state, eeka_button)) {
+                is_blacklisted = 1;
+                remove_from_blacklisted_list(state, eeka_button);
+                msg(LOG_DEBUG, "Button %d release - was blacklisted, passing through", eeka_button);
+            } else {
+
+                if (was_button_blocked(state, eeka_button)) {
+                    should_block = 1;
+                }
+                handle_button_release(state, eeka_button);
             }
-            
-            if (button_state.modifier_pressed) {
-                should_block = 1;
+        }
+        
+        if (!should_block) {
+            forward_event(mouse, ev);
+        }
+        
+    } else if (ev->type == EV_REL && is_wheel_axis(ev->code)) {
+        int should_block = 0;
+        
+        if (are_keyboard_modifiers_pressed()) {
+            msg(LOG_DEBUG, "Keyboard modifiers detected - passing scroll through");
+            forward_event(mouse, ev);
+            return;
+        }
+        
+        if (state->modifier_pressed) {
+            should_block = 1;
+        }
+        
+        // Hi-res events share the block decision of their axis, the
+        // notch events that come with them are what fires bindings
+        int ticks = ev->value < 0 ? -ev->value : ev->value;
+        if (ev->code == REL_WHEEL && ev->value != 0) {
+            handle_scroll_event(state, ev->value > 0 ? SCROLL_UP : SCROLL_DOWN, ticks);
+        } else if (ev->code == REL_HWHEEL && ev->value != 0) {
+            handle_scroll_event(state, ev->value > 0 ? SCROLL_RIGHT : SCROLL_LEFT, ticks);
+        }
+        
+        if (!should_block) {
+            forward_event(mouse, ev);
+        }
+        
+    } else {
+        forward_event(mouse, ev);
+    }
+}
+
+// Button and wheel events go through the state machine, in order
+static int is_decided_event(const struct input_event *ev) {
+    return ev->type == EV_KEY || (ev->type == EV_REL && is_wheel_axis(ev->code));
+}
+
+static int needs_keymap(const struct input_event *ev) {
+    if (keyboards_open > 0) return 0;
+    if (ev->type == EV_REL) return 1;
+
+    int button = evdev_button_to_eeka_button(ev->code);
+    return button == RBUTTON || button == BBUTTON || button == FBUTTON || button == LBUTTON;
+}
+
+// Whether the state machine looks at the window under the pointer for
+// this event. A miss only costs a blocking lookup when the event runs.
+static int needs_target(ButtonState* state, const struct input_event *ev) {
+    if (ev->type == EV_REL) return (ev->code == REL_WHEEL || ev->code == REL_HWHEEL) && ev->value != 0;
+
+    int button = evdev_button_to_eeka_button(ev->code);
+    if (ev->value == 1) {
+        return button == RBUTTON || button == BBUTTON || button == FBUTTON ||
+               (state->modifier_pressed && button != state->modifier_pressed);
+    }
+    return ev->value == 0 && button == state->modifier_pressed && !state->combo_used &&
+           was_button_blocked(state, button) && !is_currently_blacklisted(state, button);
+}
+
+// The mouse of the waiting event was closed, and its slot may already
+// serve another device whose events must not take these replies
+static int waiting_orphaned(void) {
+    return waiting_mouse && waiting_mouse->generation != waiting_generation;
+}
+
+// Replies to what the waiting event asked for; 1 once all of them are in
+static int collect_replies(void) {
+    if (keymap_waiting) {
+        xcb_query_keymap_reply_t *reply = NULL;
+        if (!xcb_poll_for_reply(connection, keymap_cookie.sequence, (void **)&reply, NULL)) {
+            return 0;
+        }
+        event_modifiers = keymap_modifiers_held(reply);
+        event_keymap_ready = 1;
+        keymap_waiting = 0;
+        free(reply);
+    }
+
+    if (window_waiting) {
+        if (!window_lookup_poll(connection)) {
+            return 0;
+        }
+        event_target = window_lookup_result();
+        event_target_ready = 1;
+        window_waiting = 0;
+    }
+    return 1;
+}
+
+// Sends the X requests a button or wheel event is decided on, unless the
+// caches answer them; 1 when the event can run now. One event waits at a
+// time, the others park behind it.
+static int prepare_event(MouseDevice* mouse, const struct input_event *ev) {
+    if (waiting_mouse) {
+        if (waiting_mouse != mouse || waiting_orphaned() || !collect_replies()) return 0;
+        waiting_mouse = NULL;
+        return 1;
+    }
+
+    if (!enabled || !grabbing_enabled) return 1;
+
+    if (!event_keymap_ready && needs_keymap(ev)) {
+        keymap_cookie = xcb_query_keymap(connection);
+        keymap_waiting = 1;
+    }
+    if (needs_target(&mouse->button_state, ev)) {
+        if (window_lookup_start(connection)) {
+            event_target = window_lookup_result();
+            event_target_ready = 1;
+        } else {
+            window_waiting = 1;
+        }
+    }
+    if (!keymap_waiting && !window_waiting) return 1;
+
+    xcb_flush(connection);
+    waiting_mouse = mouse;
+    waiting_generation = mouse->generation;
+    return 0;
+}
+
+static void run_event(MouseDevice* mouse, struct input_event *ev) {
+    latency_origin = latency_event_time(ev);
+
+    if (record_fd < 0) {
+        process_evdev_event(mouse, ev);
+    } else {
+        WindowClassInfo none = {0, 0, 0};
+        event_window = none;
+        event_decision = 0;
+        uint64_t start = latency_now();
+        process_evdev_event(mouse, ev);
+        record_event(ev, mouse - mice, &event_window, event_decision, latency_now() - start);
+    }
+
+    // Motion running while a parked event waits leaves its window alone
+    if (is_decided_event(ev)) {
+        event_target_ready = 0;
+    }
+}
+
+// A mouse whose parked queue is full is not read until its replies are
+// in, the kernel buffers its events meanwhile. Not in the epoll set
+// (toggled off), the device is left alone.
+static void poll_mouse(MouseDevice* mouse, int on) {
+    struct epoll_event ev = { .events = on ? EPOLLIN : 0, .data.u64 = EPOLL_TAG(SOURCE_MOUSE, mouse - mice) };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, mouse->fd, &ev);
+}
+
+static void park_event(MouseDevice* mouse, const struct input_event *ev) {
+    mouse->parked[mouse->parked_len++] = *ev;
+}
+
+// Runs the parked events whose replies are in. Called whenever replies
+// may have arrived. A mouse is skipped while another one's lookup is
+// out, so passes repeat until one runs nothing: a reply collected late
+// in a pass may have been read off the socket, and the X fd would not
+// wake the loop for the mice before it.
+void process_parked_events(void) {
+    int progress;
+    do {
+        progress = 0;
+
+        // Its mouse went away while the replies were out, they are read and dropped
+        if (waiting_orphaned() && collect_replies()) {
+            waiting_mouse = NULL;
+            event_target_ready = 0;
+            event_keymap_ready = 0;
+        }
+
+        for (int i = 0; i < mouse_count; i++) {
+            MouseDevice* mouse = &mice[i];
+            int full = mouse->parked_len == MOUSE_PARK_SIZE;
+            int done = 0;
+
+            while (done < mouse->parked_len && prepare_event(mouse, &mouse->parked[done])) {
+                run_event(mouse, &mouse->parked[done]);
+                done++;
             }
-            
-            if (ev->value > 0) {
-                handle_scroll_event(SCROLL_UP);
-            } else if (ev->value < 0) {
-                handle_scroll_event(SCROLL_DOWN);
+            if (done == 0) continue;
+            progress = 1;
+
+            // The frames they came in went out without them
+            struct input_event syn = mouse->parked[done - 1];
+            syn.type = EV_SYN;
+            syn.code = SYN_REPORT;
+            syn.value = 0;
+            output_event(&mouse->output, &syn);
+
+            mouse->parked_len -= done;
+            memmove(mouse->parked, mouse->parked + done, mouse->parked_len * sizeof(*mouse->parked));
+            if (full && mouse->fd >= 0) {
+                poll_mouse(mouse, 1);
             }
-            
-            if (!should_block) {
-                forward_event(ev->type, ev->code, ev->value);
+
+            // A keymap reply answers every event parked before it came in
+            if (mouse->parked_len == 0) {
+                event_keymap_ready = 0;
             }
-            
+            flush_scroll_actions();
+        }
+    } while (progress);
+}
+
+void process_evdev_events(MouseDevice* mouse) {
+    struct input_event events[64];
+
+    // Any event read may have to park, so no more are read than fit
+    size_t room = MOUSE_PARK_SIZE - mouse->parked_len;
+    if (room == 0) {
+        poll_mouse(mouse, 0);
+        return;
+    }
+    if (room > sizeof(events) / sizeof(*events)) {
+        room = sizeof(events) / sizeof(*events);
+    }
+    ssize_t bytes = read(mouse->fd, events, room * sizeof(*events));
+    
+    if (bytes < 0) {
+        if (errno == ENODEV) {
+            msg(LOG_NOTICE, "Mouse %s removed", mouse->device_path);
+            close_mouse(mouse);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            msg(LOG_ERR, "Error reading from mouse device %s: %s", mouse->device_path, strerror(errno));
+        }
+        return;
+    }
+    
+    size_t num_events = bytes / sizeof(struct input_event);
+
+    // CLOCK_REALTIME times would never compare with the monotonic ones of
+    // the histograms and deadlines; uinput restamps the events anyway
+    if (!mouse->clock_monotonic) {
+        uint64_t now = latency_now();
+        for (size_t i = 0; i < num_events; i++) {
+            events[i].input_event_sec = now / 1000000000u;
+            events[i].input_event_usec = now % 1000000000u / 1000;
+        }
+    }
+    
+    for (size_t i = 0; i < num_events; i++) {
+        struct input_event *ev = &events[i];
+
+        latency_record(LATENCY_EVDEV, latency_event_time(ev));
+
+        if (!is_decided_event(ev)) {
+            run_event(mouse, ev);
+            continue;
+        }
+        if (!waiting_mouse) {
+            event_keymap_ready = 0;
+        }
+        if (mouse->parked_len > 0 || !prepare_event(mouse, ev)) {
+            park_event(mouse, ev);
+            continue;
+        }
+        run_event(mouse, ev);
+    }
+
+    // Wheel ticks of this read go out as one action per binding
+    flush_scroll_actions();
+}
+
+// Off releases every grab and takes the mice and keyboards out of the
+// epoll set, so their events go to X with no round trip through eeka;
+// on grabs them back. Only applied with no event parked for X replies,
+// see request_toggle().
+static void apply_toggle(void) {
+    enabled = !enabled;
+    mice_grabbing = enabled;
+    msg(LOG_NOTICE, "Toggled enabled state: %s", enabled ? "ON" : "OFF");
+
+    for (int i = 0; i < mouse_count; i++) {
+        MouseDevice* mouse = &mice[i];
+        if (mouse->fd < 0) continue;
+
+        if (!enabled) {
+            release_mouse(mouse);
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, mouse->fd, NULL);
+            continue;
+        }
+        // Watched ungrabbed until the held button is released, or until
+        // a grab that failed succeeds on one of its next events
+        int grabbed = grab_mouse(mouse);
+        if (grabbed == 0) {
+            msg(LOG_NOTICE, "Button held on %s, grabbing it once released", mouse->device_path);
+        } else if (grabbed < 0) {
+            msg(LOG_WARNING, "Cannot grab %s, retrying on its next event: %s", mouse->device_path, strerror(errno));
+        }
+        watch_mouse(mouse);
+    }
+
+    // Modifier tracking only matters while the mice are grabbed
+    for (int i = 0; i < keyboard_count; i++) {
+        KeyboardDevice* keyboard = &keyboards[i];
+        if (keyboard->fd < 0) continue;
+
+        if (enabled) {
+            resync_keyboard(keyboard);
+            watch_keyboard(keyboard);
         } else {
-            forward_event(ev->type, ev->code, ev->value);
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, keyboard->fd, NULL);
         }
     }
 }
 
+static int parked_events(void) {
+    int count = 0;
+    for (int i = 0; i < mouse_count; i++) {
+        count += mice[i].parked_len;
+    }
+    return count;
+}
+
+// After parked events ran
+static void finish_toggle(void) {
+    if (disable_pending && parked_events() == 0) {
+        disable_pending = 0;
+        apply_toggle();
+    }
+}
+
+// Parked events are decided as if eeka were still on: a release parked
+// behind a press eeka swallowed must not reach X raw. Toggling off thus
+// waits for them, without blocking, and a second signal meanwhile
+// cancels it.
+static void request_toggle(void) {
+    if (!enabled) {
+        apply_toggle();
+        return;
+    }
+    disable_pending = !disable_pending;
+    if (disable_pending && parked_events() > 0) {
+        msg(LOG_DEBUG, "Toggling off once %d parked events are decided", parked_events());
+    }
+    finish_toggle();
+}
+
+// Signals are blocked in every thread and read from a signalfd in the
+// epoll set, so they are handled by the loop like any other input
+int init_signals(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        msg(LOG_ERR, "Cannot block signals: %s", strerror(errno));
+        return -1;
+    }
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        msg(LOG_ERR, "Cannot create signalfd: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void process_signals(const char* config_path) {
+    struct signalfd_siginfo info;
+
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+            case SIGINT:
+            case SIGTERM:
+                msg(LOG_NOTICE, "Received signal %u, shutting down", info.ssi_signo);
+                running = 0;
+                break;
+            case SIGUSR1:
+                request_toggle();
+                break;
+            case SIGHUP:
+                reload_config(config_path);
+                break;
+            case SIGUSR2:
+                latency_dump();
+                msg(LOG_NOTICE, "Stale actions dropped: %lu", inject_dropped());
+                msg(LOG_NOTICE, "Loop wakeups: %lu, %lu of them timeouts", loop_wakeups, loop_timeouts);
+                break;
+        }
+    }
+}
+
+// Sleep until an fd is ready unless there is work only a timeout gets
+// done: wheel ticks waiting for a token, frames the uinput fd refused
+// and buffered --record entries
+int loop_timeout(void) {
+    int pending = record_pending();
+    for (int i = 0; i < mouse_count && !pending; i++) {
+        pending = mice[i].output.retry_len > 0;
+    }
+
+    if (pending && (scroll_wait < 0 || scroll_wait > IDLE_FLUSH_MS)) {
+        return IDLE_FLUSH_MS;
+    }
+    return scroll_wait;
+}
+
+static void handle_x_event(xcb_generic_event_t *event) {
+    window_cache_handle_event(event);
+    keymap_handle_event(event);
+    free(event);
+}
+
+// Reading replies can pull events in as well, the fd does not report those
+static void process_queued_x_events(void) {
+    xcb_generic_event_t *event;
+    while ((event = xcb_poll_for_queued_event(connection)) != NULL) {
+        handle_x_event(event);
+    }
+}
+
+// The epoll set of the loop: X, signals and every open device
+int init_event_loop(void) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        msg(LOG_ERR, "Cannot create epoll set: %s", strerror(errno));
+        return -1;
+    }
+
+    watch_fd(xcb_get_file_descriptor(connection), SOURCE_X, 0);
+    watch_fd(signal_fd, SOURCE_SIGNAL, 0);
+    for (int i = 0; i < keyboard_count; i++) {
+        if (keyboards[i].fd >= 0) watch_fd(keyboards[i].fd, SOURCE_KEYBOARD, i);
+    }
+    for (int i = 0; i < mouse_count; i++) {
+        if (mice[i].fd >= 0) watch_fd(mice[i].fd, SOURCE_MOUSE, i);
+    }
+    if (hotplug_fd >= 0) {
+        watch_fd(hotplug_fd, SOURCE_HOTPLUG, 0);
+    }
+    return 0;
+}
+
+// One wait for input and the work it brings; -1 when the loop cannot go on
+int loop_round(const char* config_path) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int ready = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, loop_timeout());
+    
+    if (ready < 0) {
+        if (errno == EINTR) return 0;
+        msg(LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
+        return -1;
+    }
+    loop_wakeups++;
+
+    if (ready == 0) {
+        // Idle, give frames the uinput fd refused another chance
+        loop_timeouts++;
+        for (int i = 0; i < mouse_count; i++) {
+            output_retry(&mice[i].output);
+        }
+        record_flush();
+        process_parked_events();
+        process_queued_x_events();
+        scroll_wait = flush_scroll_actions();
+        finish_toggle();
+        return 0;
+    }
+    
+    // Keyboards first so modifier state is current for the mouse events.
+    // Closed devices leave the set on close(), their slots stay unused.
+    for (int i = 0; i < ready; i++) {
+        uint32_t index = EPOLL_INDEX(events[i].data.u64);
+
+        switch (EPOLL_SOURCE(events[i].data.u64)) {
+            case SOURCE_X: {
+                xcb_generic_event_t *event;
+                while ((event = xcb_poll_for_event(connection)) != NULL) {
+                    handle_x_event(event);
+                }
+                break;
+            }
+            case SOURCE_KEYBOARD:
+                if (keyboards[index].fd >= 0) {
+                    process_keyboard_events(&keyboards[index]);
+                }
+                break;
+            case SOURCE_HOTPLUG:
+                process_hotplug_events(&hotplug_handlers);
+                break;
+            case SOURCE_SIGNAL:
+                process_signals(config_path);
+                break;
+        }
+    }
+
+    // Parked events run before newer ones from their mouse
+    process_parked_events();
+    process_queued_x_events();
+
+    for (int i = 0; i < ready; i++) {
+        uint32_t index = EPOLL_INDEX(events[i].data.u64);
+
+        switch (EPOLL_SOURCE(events[i].data.u64)) {
+            case SOURCE_MOUSE:
+                // Toggled off by a signal read in this round
+                if (!enabled) break;
+                if (mice[index].fd >= 0 && !mice[index].grabbed) {
+                    grab_mouse(&mice[index]);
+                } else if (mice[index].fd >= 0) {
+                    process_evdev_events(&mice[index]);
+                    output_retry(&mice[index].output);
+                }
+                break;
+        }
+    }
+    flush_scroll_actions();
+
+    // Replies and events libxcb read in meanwhile never make its fd
+    // ready again, so they are handled before the loop sleeps
+    process_parked_events();
+    process_queued_x_events();
+
+    // Last, as parked wheel ticks may only have been queued just now
+    scroll_wait = flush_scroll_actions();
+    finish_toggle();
+    return 0;
+}
+
 static void create_pidfile_path(void) {
     char* runtime_dir = xdg_get_directory(XDG_RUNTIME_DIR);
     if (runtime_dir) {
@@ -805,18 +1169,24 @@ static void create_pidfile_path(void) {
 
 int main(int argc, char *argv[]) {
     const char *config_path = "/etc/eeka.conf";
+    const char *record_path = NULL;
+    int realtime = 0;
+    int realtime_cpu = -1;
     int opt;
     static struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
         {"config", required_argument, 0, 'c'},
         {"verbose", no_argument, 0, 'V'},
         {"toggle", no_argument, 0, 't'},
+        {"record", required_argument, 0, 'r'},
+        {"inject", required_argument, 0, 'i'},
+        {"realtime", optional_argument, 0, 'R'},
         {0, 0, 0, 0}
     };
 
     create_pidfile_path();
 
-    while ((opt = getopt_long(argc, argv, "hc:Vt", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hc:Vtr:i:R::", long_options, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0]);
@@ -829,6 +1199,30 @@ int main(int argc, char *argv[]) {
                 break;
             case 't':
                 return toggle_eeka_daemon();
+            case 'r':
+                record_path = optarg;
+                break;
+            case 'i':
+                if (strcmp(optarg, "uinput") == 0) {
+                    inject_backend = INJECT_UINPUT;
+                } else if (strcmp(optarg, "xtest") == 0) {
+                    inject_backend = INJECT_XTEST;
+                } else {
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'R':
+                realtime = 1;
+                if (optarg) {
+                    char *end;
+                    realtime_cpu = (int)strtol(optarg, &end, 10);
+                    if (*end || realtime_cpu < 0) {
+                        print_usage(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                }
+                break;
             default:
                 print_usage(argv[0]);
                 return EXIT_FAILURE;
@@ -838,9 +1232,16 @@ int main(int argc, char *argv[]) {
     create_pidfile();
     parse_config_file(config_path);
 
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
-    signal(SIGUSR1, toggle_signal_handler);
+    // Before any thread is started, they all inherit the mask
+    if (init_signals() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // Starts the trace writer thread, at normal priority as --realtime
+    // is only applied further down
+    if (record_path && record_open(record_path) < 0) {
+        return EXIT_FAILURE;
+    }
 
     connection = xcb_connect(NULL, NULL);
     if (xcb_connection_has_error(connection)) {
@@ -855,52 +1256,63 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    if (init_evdev() < 0) {
-        msg(LOG_ERR, "Failed to initialize evdev");
+    keymap_build(connection);
+    init_focus_tracking(connection);
+    init_pointer_tracking(connection);
+
+    init_hotplug();
+
+    if (init_mice() == 0) {
+        if (hotplug_fd < 0) {
+            msg(LOG_ERR, "Failed to initialize evdev");
+            xcb_disconnect(connection);
+            return EXIT_FAILURE;
+        }
+        msg(LOG_WARNING, "Waiting for a mouse to be plugged in");
+    }
+    
+    init_keyboards();
+
+    // Before the injector starts, so its thread inherits the scheduling
+    if (realtime) {
+        realtime_enable(realtime_cpu);
+    }
+
+    if (init_injector() < 0) {
+        msg(LOG_ERR, "Failed to initialize injector");
+        cleanup_keyboards();
+        cleanup_mice();
+        cleanup_hotplug();
         xcb_disconnect(connection);
         return EXIT_FAILURE;
     }
-    
-    if (init_uinput() < 0) {
-        msg(LOG_ERR, "Failed to initialize uinput");
-        cleanup_evdev();
+
+    if (init_event_loop() < 0) {
+        cleanup_injector();
+        cleanup_keyboards();
+        cleanup_mice();
+        cleanup_hotplug();
         xcb_disconnect(connection);
         return EXIT_FAILURE;
     }
 
     msg(LOG_NOTICE, "eeka started successfully");
-    
-    int xcb_fd = xcb_get_file_descriptor(connection);
-    
+
     while (running) {
-        struct pollfd fds[2];
-        fds[0].fd = xcb_fd;
-        fds[0].events = POLLIN;
-        fds[1].fd = evdev_ctx.mouse_fd;
-        fds[1].events = POLLIN;
-        
-        int poll_result = poll(fds, 2, 100);
-        
-        if (poll_result < 0) {
-            if (errno == EINTR) continue;
-            msg(LOG_ERR, "poll() failed: %s", strerror(errno));
-            break;
-        }
-        
-        if (fds[0].revents & POLLIN) {
-            xcb_generic_event_t *event;
-            while ((event = xcb_poll_for_event(connection)) != NULL) {
-                free(event);
-            }
-        }
-        
-        if (fds[1].revents & POLLIN) {
-            process_evdev_events();
-        }
+        if (loop_round(config_path) < 0) break;
     }
 
-    cleanup_evdev();
-    cleanup_uinput();
+    cleanup_injector();
+    cleanup_keyboards();
+    cleanup_mice();
+    cleanup_hotplug();
+    close(epoll_fd);
+    close(signal_fd);
+    record_close();
+    keymap_free();
+    cleanup_window_tracking();
+    free_config();
+    intern_free();
     
     if (connection) {
         xcb_disconnect(connection);
@@ -911,18 +1323,18 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
 }
 
+// Called from the injector thread as well, so each line is formatted
+// first and handed to stdio in one call, which takes the stream's lock
 void msg(int priority, const char* format, ...) {
     
     if (!verbose && priority > LOG_WARNING) return;
     
-    va_list args;
-    va_start(args, format);
     time_t now;
-    struct tm *tm_info;
+    struct tm tm_info;
     char timestamp[26];
     time(&now);
-    tm_info = localtime(&now);
-    strftime(timestamp, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+    localtime_r(&now, &tm_info);
+    strftime(timestamp, 26, "%Y-%m-%d %H:%M:%S", &tm_info);
     const char* priority_str;
     switch (priority) {
         case LOG_DEBUG: priority_str = "DEBUG"; break;
@@ -931,9 +1343,20 @@ void msg(int priority, const char* format, ...) {
         case LOG_ERR: priority_str = "ERROR"; break;
         default: priority_str = "INFO"; break;
     }
-    fprintf(stdout, "%s [%s] ", timestamp, priority_str);
-    vfprintf(stdout, format, args);
-    fprintf(stdout, "\n");
-    fflush(stdout);
+
+    char line[1024];
+    int len = snprintf(line, sizeof(line), "%s [%s] ", timestamp, priority_str);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line + len, sizeof(line) - len - 1, format, args);
     va_end(args);
+    // Truncated lines still end in a newline
+    len = strlen(line);
+    line[len++] = '\n';
+    line[len] = '\0';
+
+    flockfile(stdout);
+    fputs(line, stdout);
+    fflush(stdout);
+    funlockfile(stdout);
 }
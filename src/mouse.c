@@ -0,0 +1,275 @@
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "mouse.h"
+#include "parser.h"
+#include "eeka.h"
+
+// Every pointer device that passes the capability test is grabbed, and
+// each one gets its own uinput mirror and its own ButtonState, so a held
+// RButton on one mouse never turns a wheel tick on another into a combo.
+
+MouseDevice mice[MAX_MICE];
+int mouse_count = 0;
+int mice_open = 0;
+
+// Cleared while eeka is toggled off: the grabs are released and the
+// mice, still open, report straight to X
+int mice_grabbing = 1;
+
+static int is_pointer_device(int fd) {
+    unsigned long evbit[BITS_TO_LONGS(EV_CNT)] = {0};
+    unsigned long keybit[BITS_TO_LONGS(KEY_CNT)] = {0};
+    unsigned long relbit[BITS_TO_LONGS(REL_CNT)] = {0};
+
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), evbit) < 0 ||
+        ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybit)), keybit) < 0 ||
+        ioctl(fd, EVIOCGBIT(EV_REL, sizeof(relbit)), relbit) < 0) {
+        return 0;
+    }
+
+    return test_bit(EV_KEY, evbit) && test_bit(EV_REL, evbit) &&
+           test_bit(BTN_LEFT, keybit) && test_bit(BTN_RIGHT, keybit) &&
+           test_bit(REL_X, relbit) && test_bit(REL_Y, relbit);
+}
+
+static long elapsed_ms(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// A slot whose device was unplugged is reused, preferably the one the
+// same device had before so its reconnect time can be reported
+static MouseDevice* free_slot(const char* name) {
+    MouseDevice* slot = NULL;
+    for (int i = 0; i < mouse_count; i++) {
+        if (mice[i].fd >= 0) continue;
+        if (strcmp(mice[i].name, name) == 0) return &mice[i];
+        if (!slot) slot = &mice[i];
+    }
+    if (!slot && mouse_count < MAX_MICE) {
+        slot = &mice[mouse_count++];
+        memset(slot, 0, sizeof(*slot));
+        slot->fd = -1;
+        slot->output.fd = -1;
+    }
+    return slot;
+}
+
+static MouseDevice* attach_mouse(int fd, const char* path, const char* name) {
+    MouseDevice* mouse = free_slot(name);
+    if (!mouse) {
+        msg(LOG_WARNING, "Too many mice (max %d), not grabbing %s", MAX_MICE, path);
+        return NULL;
+    }
+
+    int index = mouse - mice;
+    int reconnect = mouse->name[0] && strcmp(mouse->name, name) == 0;
+    struct timespec removed_at = mouse->removed_at;
+    unsigned int generation = mouse->generation;
+
+    memset(mouse, 0, sizeof(*mouse));
+    mouse->generation = generation;
+    mouse->fd = -1;
+    snprintf(mouse->device_path, sizeof(mouse->device_path), "%s", path);
+    snprintf(mouse->name, sizeof(mouse->name), "%s", name);
+
+    // The mirror has to exist before the grab, or the device goes dead
+    char mirror_name[80];
+    snprintf(mirror_name, sizeof(mirror_name), "eeka virtual mouse %d", index);
+    if (output_open(&mouse->output, mirror_name, fd) < 0) {
+        return NULL;
+    }
+
+    // Grab exclusive access to prevent events reaching other applications
+    if (mice_grabbing) {
+        if (ioctl(fd, EVIOCGRAB, 1) < 0) {
+            msg(LOG_ERR, "Cannot grab exclusive access to %s: %s", path, strerror(errno));
+            output_close(&mouse->output);
+            return NULL;
+        }
+        mouse->grabbed = 1;
+    }
+
+    // Monotonic timestamps, the clock latency_now() and the injector's
+    // deadlines use; without them events are timed when they are read
+    int clock_id = CLOCK_MONOTONIC;
+    if (ioctl(fd, EVIOCSCLOCKID, &clock_id) == 0) {
+        mouse->clock_monotonic = 1;
+    } else {
+        msg(LOG_WARNING, "Cannot set monotonic clock on %s, timing its events when read: %s",
+            path, strerror(errno));
+    }
+
+    mouse->fd = fd;
+    mice_open++;
+    msg(LOG_NOTICE, "%s %s (%s)", mouse->grabbed ? "Grabbed exclusive access to" : "Opened", path, name);
+    if (reconnect) {
+        msg(LOG_NOTICE, "Mouse %s reconnected after %ld ms", name, elapsed_ms(&removed_at));
+    }
+    return mouse;
+}
+
+MouseDevice* open_mouse(const char* path) {
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) return NULL;
+
+    if (!is_pointer_device(fd)) {
+        close(fd);
+        return NULL;
+    }
+
+    char name[256] = "Unknown";
+    ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+
+    // Our own mirrors pass the capability test too
+    if (strncmp(name, "eeka ", 5) == 0 || is_device_blacklisted(name)) {
+        msg(LOG_DEBUG, "Skipping device: %s (%s)", path, name);
+        close(fd);
+        return NULL;
+    }
+
+    MouseDevice* mouse = attach_mouse(fd, path, name);
+    if (!mouse) {
+        close(fd);
+    }
+    return mouse;
+}
+
+int init_mice(void) {
+    DIR *dir = opendir("/dev/input");
+    if (!dir) {
+        msg(LOG_ERR, "Cannot open /dev/input directory");
+        return 0;
+    }
+
+    struct dirent *entry;
+    mouse_count = 0;
+    mice_open = 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "event", 5) != 0) continue;
+
+        char full_path[280];
+        snprintf(full_path, sizeof(full_path), "/dev/input/%s", entry->d_name);
+        open_mouse(full_path);
+    }
+
+    closedir(dir);
+
+    if (mice_open == 0) {
+        msg(LOG_ERR, "No suitable mouse device found");
+    }
+
+    return mice_open;
+}
+
+// After a config reload: release mice that are blacklisted now and grab
+// the ones that were only skipped because of the old blacklist
+void refresh_mice(void (*attached)(MouseDevice* mouse)) {
+    for (int i = 0; i < mouse_count; i++) {
+        if (mice[i].fd >= 0 && is_device_blacklisted(mice[i].name)) {
+            msg(LOG_NOTICE, "Releasing blacklisted device: %s (%s)", mice[i].device_path, mice[i].name);
+            close_mouse(&mice[i]);
+        }
+    }
+
+    DIR *dir = opendir("/dev/input");
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "event", 5) != 0) continue;
+
+        char full_path[280];
+        snprintf(full_path, sizeof(full_path), "/dev/input/%s", entry->d_name);
+        if (find_mouse(full_path)) continue;
+
+        MouseDevice* mouse = open_mouse(full_path);
+        if (mouse && attached) {
+            attached(mouse);
+        }
+    }
+
+    closedir(dir);
+}
+
+void close_mouse(MouseDevice* mouse) {
+    if (mouse->fd >= 0) {
+        release_mouse(mouse);
+        close(mouse->fd);
+        mouse->fd = -1;
+        mice_open--;
+        mouse->generation++;
+        clock_gettime(CLOCK_MONOTONIC, &mouse->removed_at);
+    }
+    mouse->parked_len = 0;
+    output_close(&mouse->output);
+}
+
+// Takes the grab back after toggling on. What the device queued while X
+// had it is stale and discarded. A button still held stays with X until
+// it is released, or X would never see the release of its own press;
+// returns 0 while that is the case and -1, errno set, if the grab
+// failed. Either way the caller tries again on the next event.
+int grab_mouse(MouseDevice* mouse) {
+    if (mouse->fd < 0 || mouse->grabbed) return 1;
+
+    struct input_event stale[64];
+    while (read(mouse->fd, stale, sizeof(stale)) > 0);
+
+    unsigned long keys[BITS_TO_LONGS(KEY_CNT)] = {0};
+    if (ioctl(mouse->fd, EVIOCGKEY(sizeof(keys)), keys) == 0) {
+        for (int code = BTN_MOUSE; code < BTN_JOYSTICK; code++) {
+            if (test_bit(code, keys)) return 0;
+        }
+    }
+
+    if (ioctl(mouse->fd, EVIOCGRAB, 1) < 0) {
+        int err = errno;
+        msg(LOG_DEBUG, "Cannot grab exclusive access to %s: %s", mouse->device_path, strerror(err));
+        errno = err;
+        return -1;
+    }
+    memset(&mouse->button_state, 0, sizeof(mouse->button_state));
+    mouse->parked_len = 0;
+    mouse->grabbed = 1;
+    msg(LOG_DEBUG, "Grabbed %s again", mouse->device_path);
+    return 1;
+}
+
+void release_mouse(MouseDevice* mouse) {
+    if (mouse->fd < 0 || !mouse->grabbed) return;
+
+    ioctl(mouse->fd, EVIOCGRAB, 0);
+    mouse->grabbed = 0;
+}
+
+void cleanup_mice(void) {
+    for (int i = 0; i < mouse_count; i++) {
+        close_mouse(&mice[i]);
+    }
+    mouse_count = 0;
+    mice_open = 0;
+}
+
+MouseDevice* find_mouse(const char* path) {
+    for (int i = 0; i < mouse_count; i++) {
+        if (mice[i].fd >= 0 && strcmp(mice[i].device_path, path) == 0) {
+            return &mice[i];
+        }
+    }
+    return NULL;
+}
+
+int is_mouse_path(const char* path) {
+    return find_mouse(path) != NULL;
+}
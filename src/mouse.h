@@ -0,0 +1,39 @@
+#pragma once
+
+#include <time.h>
+
+#include "eeka.h"
+#include "output.h"
+
+#define MAX_MICE 8
+#define MOUSE_PARK_SIZE 64
+
+typedef struct {
+    int fd;
+    unsigned int generation;    // bumped when the slot's device is closed
+    char device_path[280];
+    char name[256];
+    ButtonState button_state;
+    int grabbed;
+    int clock_monotonic;    // event times on the clock latency_now() reads
+    OutputDevice output;
+    struct timespec removed_at;
+    // Button and wheel events waiting for the X replies they are decided on
+    struct input_event parked[MOUSE_PARK_SIZE];
+    int parked_len;
+} MouseDevice;
+
+extern MouseDevice mice[MAX_MICE];
+extern int mouse_count;
+extern int mice_open;
+extern int mice_grabbing;
+
+int          init_mice(void);
+void         cleanup_mice(void);
+MouseDevice* open_mouse(const char* path);
+void         refresh_mice(void (*attached)(MouseDevice* mouse));
+void         close_mouse(MouseDevice* mouse);
+int          grab_mouse(MouseDevice* mouse);
+void         release_mouse(MouseDevice* mouse);
+MouseDevice* find_mouse(const char* path);
+int          is_mouse_path(const char* path);
@@ -0,0 +1,181 @@
+#include <linux/uinput.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "output.h"
+#include "eeka.h"
+#include "latency.h"
+
+// Events are collected per source frame and written with one writev()
+// when the frame's SYN_REPORT arrives. uinput stamps every event with
+// the time of that write, the source timestamps are not kept. Frames the
+// non-blocking fd refuses are kept in a bounded retry queue and written
+// in front of the next frame.
+
+int output_open(OutputDevice* out, const char* name, int source_fd) {
+    memset(out, 0, sizeof(*out));
+
+    out->fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (out->fd < 0) {
+        msg(LOG_ERR, "Cannot open /dev/uinput: %s", strerror(errno));
+        return -1;
+    }
+
+    // Enable event types
+    ioctl(out->fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(out->fd, UI_SET_EVBIT, EV_REL);
+    ioctl(out->fd, UI_SET_EVBIT, EV_SYN);
+
+    // Mirror the buttons and axes of the source device
+    unsigned long keybit[BITS_TO_LONGS(KEY_CNT)] = {0};
+    unsigned long relbit[BITS_TO_LONGS(REL_CNT)] = {0};
+    ioctl(source_fd, EVIOCGBIT(EV_KEY, sizeof(keybit)), keybit);
+    ioctl(source_fd, EVIOCGBIT(EV_REL, sizeof(relbit)), relbit);
+
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (test_bit(code, keybit)) ioctl(out->fd, UI_SET_KEYBIT, code);
+    }
+    for (int code = 0; code < REL_CNT; code++) {
+        if (test_bit(code, relbit)) ioctl(out->fd, UI_SET_RELBIT, code);
+    }
+
+    struct uinput_user_dev udev = {0};
+    snprintf(udev.name, sizeof(udev.name), "%s", name);
+    udev.id.bustype = BUS_USB;
+    udev.id.vendor = 0x1234;
+    udev.id.product = 0x5678;
+    udev.id.version = 1;
+
+    write(out->fd, &udev, sizeof(udev));
+    ioctl(out->fd, UI_DEV_CREATE);
+
+    msg(LOG_NOTICE, "Created virtual device: %s", name);
+    return 0;
+}
+
+void output_close(OutputDevice* out) {
+    if (out->fd >= 0) {
+        if (out->frames_dropped) {
+            msg(LOG_WARNING, "uinput dropped %lu frames (%lu events) of %lu written",
+                out->frames_dropped, out->events_dropped, out->frames_written);
+        }
+        ioctl(out->fd, UI_DEV_DESTROY);
+        close(out->fd);
+        out->fd = -1;
+    }
+}
+
+static void drop_frame(OutputDevice* out) {
+    out->frames_dropped++;
+    out->events_dropped += out->frame_len;
+    out->frame_len = 0;
+    msg(LOG_DEBUG, "uinput busy, dropped frame (%lu dropped so far)", out->frames_dropped);
+}
+
+// Write the retry backlog and the current frame in a single writev()
+static void output_write(OutputDevice* out) {
+    const size_t size = sizeof(struct input_event);
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    if (out->retry_len > 0) {
+        iov[iovcnt].iov_base = out->retry;
+        iov[iovcnt].iov_len = out->retry_len * size;
+        iovcnt++;
+    }
+    if (out->frame_len > 0) {
+        iov[iovcnt].iov_base = out->frame;
+        iov[iovcnt].iov_len = out->frame_len * size;
+        iovcnt++;
+    }
+    if (iovcnt == 0) {
+        return;
+    }
+
+    ssize_t bytes = writev(out->fd, iov, iovcnt);
+
+    if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        msg(LOG_ERR, "Error writing to uinput: %s", strerror(errno));
+        out->events_dropped += out->retry_len;
+        out->retry_len = 0;
+        drop_frame(out);
+        return;
+    }
+
+    int written = bytes < 0 ? 0 : (int)(bytes / size);
+
+    // Frames of the backlog that are out now, counted by their SYN_REPORT
+    for (int i = 0; i < written && i < out->retry_len; i++) {
+        if (out->retry[i].type == EV_SYN && out->retry[i].code == SYN_REPORT) {
+            out->frames_written++;
+        }
+    }
+
+    // Whatever was not accepted moves to the front of the retry queue
+    int retry_left = out->retry_len > written ? out->retry_len - written : 0;
+    int frame_written = written > out->retry_len ? written - out->retry_len : 0;
+    int frame_left = out->frame_len - frame_written;
+
+    if (retry_left > 0 && written > 0) {
+        memmove(out->retry, out->retry + written, retry_left * size);
+    }
+    out->retry_len = retry_left;
+
+    if (frame_left > 0) {
+        if (out->retry_len + frame_left > OUTPUT_RETRY_SIZE) {
+            out->frame_len = frame_left;
+            drop_frame(out);
+            return;
+        }
+        memcpy(out->retry + out->retry_len, out->frame + frame_written, frame_left * size);
+        out->retry_len += frame_left;
+    } else if (out->frame_len > 0) {
+        out->frames_written++;
+        latency_record(LATENCY_UINPUT, latency_event_time(&out->frame[0]));
+    }
+    out->frame_len = 0;
+}
+
+void output_event(OutputDevice* out, const struct input_event* ev) {
+    if (out->fd < 0) return;
+
+    if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+        // The kernel dropped events, the frame being built is incomplete
+        out->frame_len = 0;
+        return;
+    }
+
+    if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+        // Every event of this frame was consumed, nothing to report
+        if (out->frame_len == 0) {
+            if (out->retry_len > 0) output_write(out);
+            return;
+        }
+        out->frame[out->frame_len++] = *ev;
+        output_write(out);
+        return;
+    }
+
+    if (out->frame_len == OUTPUT_FRAME_SIZE - 1) {
+        // Oversized frame, write what we have and let the rest follow
+        struct input_event syn = *ev;
+        syn.type = EV_SYN;
+        syn.code = SYN_REPORT;
+        syn.value = 0;
+        out->frame[out->frame_len++] = syn;
+        output_write(out);
+    }
+
+    out->frame[out->frame_len++] = *ev;
+}
+
+void output_retry(OutputDevice* out) {
+    if (out->fd >= 0 && out->retry_len > 0) {
+        output_write(out);
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <linux/input.h>
+
+#define OUTPUT_FRAME_SIZE 64
+#define OUTPUT_RETRY_SIZE 256
+
+typedef struct {
+    int fd;
+    struct input_event frame[OUTPUT_FRAME_SIZE];
+    int frame_len;
+    struct input_event retry[OUTPUT_RETRY_SIZE];
+    int retry_len;
+    unsigned long frames_written;
+    unsigned long frames_dropped;
+    unsigned long events_dropped;
+} OutputDevice;
+
+int  output_open(OutputDevice* out, const char* name, int source_fd);
+void output_close(OutputDevice* out);
+void output_event(OutputDevice* out, const struct input_event* ev);
+void output_retry(OutputDevice* out);
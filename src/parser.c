@@ -3,23 +3,44 @@
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <regex.h>
 
 #include "parser.h"
 #include "config.h"
 #include "eeka.h"
 #include "xdg.h"
+#include "intern.h"
 
-static KeyBinding bindings[MAX_BINDINGS];
-static WindowRule window_rules[MAX_WINDOW_RULES];
-static int binding_count = 0;
-static int window_rule_count = 0;
+// The parsed config is a separately allocated snapshot. A reload parses
+// into a fresh one and then swaps this pointer, so lookups always see
+// either the old or the new config, never a table that is half written.
+static Config* current_config = NULL;
 
-DeviceConfig device_config = {0};
-
-int parse_window_rule(FILE* config, const char* first_line);
+int parse_window_rule(Config* cfg, FILE* config, const char* first_line);
 int button_name_to_number(const char* button_name);
 void parse_window_blacklist_line(WindowRule* rule, const char* blacklist_str);
-static void parse_device_blacklist_line(const char* blacklist_str);
+static void parse_device_blacklist_line(Config* cfg, const char* blacklist_str);
+static void parse_focus_line(Config* cfg, const char* policy);
+static void parse_scroll_rate_line(Config* cfg, const char* rate);
+static int compile_binding_tables(Config* cfg);
+static void destroy_config(Config* cfg);
+static inline const Action* binding_table_lookup(const BindingTable* table, int first_button, int second_button);
+
+static WindowRule* add_window_rule(Config* cfg) {
+    if (!arena_reserve(&cfg->arena, (void**)&cfg->window_rules, &cfg->window_rule_capacity,
+                       cfg->window_rule_count, sizeof(WindowRule))) {
+        return NULL;
+    }
+    return &cfg->window_rules[cfg->window_rule_count++];
+}
+
+static int add_binding(Config* cfg, KeyBinding** bindings, int* count, int* capacity, const KeyBinding* binding) {
+    if (!arena_reserve(&cfg->arena, (void**)bindings, capacity, *count, sizeof(KeyBinding))) {
+        return 0;
+    }
+    (*bindings)[(*count)++] = *binding;
+    return 1;
+}
 
 const char* get_action_name(const Action* action) {
     static char action_str[64];
@@ -146,6 +167,8 @@ const char* get_button_name(int button) {
         case 3: return "RButton (3)";
         case 4: return "ScrollUp (4)";
         case 5: return "ScrollDown (5)";
+        case 6: return "ScrollLeft (6)";
+        case 7: return "ScrollRight (7)";
         case 8: return "BButton (8)";
         case 9: return "FButton (9)";
         default: {
@@ -159,7 +182,8 @@ const char* get_button_name(int button) {
 int button_name_to_number(const char* button_name) {
     int button_num = 0;
     if (sscanf(button_name, "Button%d", &button_num) == 1) {
-        return button_num;
+        // Anything past the lookup table could never be bound
+        return button_num > 0 && button_num < BINDING_TABLE_SIZE ? button_num : 0;
     }
     if (strcasecmp(button_name, "LButton") == 0) return 1;
     if (strcasecmp(button_name, "MButton") == 0) return 2;
@@ -168,6 +192,8 @@ int button_name_to_number(const char* button_name) {
     if (strcasecmp(button_name, "FButton") == 0) return 9;
     if (strcasecmp(button_name, "ScrollUp") == 0) return 4;
     if (strcasecmp(button_name, "ScrollDown") == 0) return 5;
+    if (strcasecmp(button_name, "ScrollLeft") == 0) return 6;
+    if (strcasecmp(button_name, "ScrollRight") == 0) return 7;
     return 0;
 }
 
@@ -213,7 +239,7 @@ int parse_binding_line(const char* line, KeyBinding* binding) {
 void parse_window_blacklist_line(WindowRule* rule, const char* blacklist_str) {
     char* token_start = (char*)blacklist_str;
     
-    while (*token_start && rule->blacklist_count < MAX_BUTTONS_PER_RULE) {
+    while (*token_start) {
         // Skip whitespace and commas
         while (*token_start && (isspace(*token_start) || *token_start == ',')) {
             token_start++;
@@ -237,7 +263,7 @@ void parse_window_blacklist_line(WindowRule* rule, const char* blacklist_str) {
         // Convert to button number
         int button_num = button_name_to_number(button_name);
         if (button_num > 0) {
-            rule->blacklisted_buttons[rule->blacklist_count++] = button_num;
+            rule->blacklist |= 1u << button_num;
             msg(LOG_NOTICE, "Blacklisted button %s (%d) for window rule", 
                 button_name, button_num);
         } else {
@@ -248,71 +274,166 @@ void parse_window_blacklist_line(WindowRule* rule, const char* blacklist_str) {
     }
 }
 
-int parse_window_rule(FILE* config, const char* first_line) {
-    char instance[128] = {0};
-    char class_name[128] = {0};
+// Read "key=value" out of the rule criteria. A value starting with '/'
+// is a regex and runs to the closing '/' (plus an optional 'i' flag),
+// so it may contain commas; any other value ends at the next comma.
+static void parse_criterion(const char* criteria, const char* key, char* value, size_t size) {
+    value[0] = '\0';
+    const char* start = strstr(criteria, key);
+    if (!start) return;
+    start += strlen(key);
+    while (*start && isspace(*start)) start++;
+
+    const char* end;
+    if (*start == '/') {
+        end = start + 1;
+        while (*end && *end != '/') {
+            if (*end == '\\' && end[1]) end++;
+            end++;
+        }
+        if (*end == '/') end++;
+        if (*end == 'i') end++;
+    } else {
+        end = strchr(start, ',');
+        if (!end) end = start + strlen(start);
+    }
+
+    int len = end - start;
+    if (len > (int)size - 1) len = (int)size - 1;
+    memcpy(value, start, len);
+    value[len] = '\0';
+
+    char* p = value + strlen(value) - 1;
+    while (p >= value && isspace(*p)) *p-- = '\0';
+}
+
+// Turn a glob into an anchored extended regex, so both kinds of
+// pattern are compiled and matched the same way
+static void glob_to_regex(const char* glob, char* regex, size_t size) {
+    size_t n = 0;
+    regex[n++] = '^';
+    for (const char* p = glob; *p && n + 4 < size; p++) {
+        if (*p == '*') {
+            regex[n++] = '.';
+            regex[n++] = '*';
+        } else if (*p == '?') {
+            regex[n++] = '.';
+        } else if (*p == '[') {
+            regex[n++] = *p++;
+            if (*p == '!') {
+                regex[n++] = '^';
+                p++;
+            }
+            // A ] right after the opening one is a member, in both syntaxes
+            if (*p == ']') regex[n++] = *p++;
+            while (*p && *p != ']' && n + 3 < size) regex[n++] = *p++;
+            if (!*p) break;
+            regex[n++] = ']';
+        } else {
+            if (strchr(".^$+(){}|\\", *p)) regex[n++] = '\\';
+            regex[n++] = *p;
+        }
+    }
+    regex[n++] = '$';
+    regex[n] = '\0';
+}
+
+// Exact names stay interned ids; "/regex/" (or "/regex/i") and globs
+// containing * ? or [ are compiled once here. Returns the pattern index,
+// -1 for an exact name, -2 when the pattern does not compile.
+static int compile_criterion(Config* cfg, const char* value) {
+    char regex[2048];
+    int flags = REG_EXTENDED | REG_NOSUB;
+    size_t len = strlen(value);
+
+    if (len >= 2 && value[0] == '/' && (value[len - 1] == '/' || (len >= 3 && value[len - 1] == 'i' && value[len - 2] == '/'))) {
+        size_t body = value[len - 1] == 'i' ? len - 3 : len - 2;
+        if (value[len - 1] == 'i') flags |= REG_ICASE;
+        if (body >= sizeof(regex)) body = sizeof(regex) - 1;
+        memcpy(regex, value + 1, body);
+        regex[body] = '\0';
+    } else if (strpbrk(value, "*?[")) {
+        glob_to_regex(value, regex, sizeof(regex));
+    } else {
+        return -1;
+    }
+
+    regex_t* pattern = arena_alloc(&cfg->arena, sizeof(regex_t));
+    if (!pattern ||
+        !arena_reserve(&cfg->arena, (void**)&cfg->patterns, &cfg->pattern_capacity,
+                       cfg->pattern_count, sizeof(regex_t*))) {
+        msg(LOG_ERR, "Failed to allocate pattern %s", value);
+        return -2;
+    }
+
+    int err = regcomp(pattern, regex, flags);
+    if (err != 0) {
+        char error[128];
+        regerror(err, pattern, error, sizeof(error));
+        msg(LOG_ERR, "Invalid pattern %s: %s", value, error);
+        return -2;
+    }
+
+    cfg->patterns[cfg->pattern_count] = pattern;
+    return cfg->pattern_count++;
+}
+
+// Drop a rule with a pattern that did not compile, and its bindings, it
+// could never match
+static void drop_window_rule(Config* cfg, int rule_index, const char* first_line) {
+    msg(LOG_ERR, "Ignoring window rule with invalid pattern: %s", first_line);
+    cfg->rule_binding_count = cfg->window_rules[rule_index].first_binding;
+    cfg->window_rule_count = rule_index;
+}
+
+int parse_window_rule(Config* cfg, FILE* config, const char* first_line) {
+    char instance[1024] = {0};
+    char class_name[1024] = {0};
     char* criteria_start = strchr(first_line, '[');
     if (!criteria_start) {
         msg(LOG_ERR, "Missing criteria for window rule: %s", first_line);
         return 0;
     }
-    char* criteria_end = strchr(criteria_start, ']');
+    // Last bracket, a regex or glob may contain one
+    char* criteria_end = strrchr(criteria_start, ']');
     if (!criteria_end) {
         msg(LOG_ERR, "Missing closing bracket for window rule criteria: %s", first_line);
         return 0;
     }
-    char criteria[128] = {0};
+    char criteria[1024] = {0};
     int criteria_len = criteria_end - criteria_start - 1;
     if (criteria_len >= (int)sizeof(criteria)) criteria_len = (int)sizeof(criteria) - 1;
     strncpy(criteria, criteria_start + 1, criteria_len);
     criteria[criteria_len] = '\0';
-    char* instance_part = strstr(criteria, "instance=");
-    char* class_part = strstr(criteria, "class=");
-    if (instance_part) {
-        instance_part += 9;
-        char* end = strchr(instance_part, ',');
-        if (!end) end = instance_part + strlen(instance_part);
-        int len = end - instance_part;
-        if (len > (int)sizeof(instance) - 1) len = (int)sizeof(instance) - 1;
-        strncpy(instance, instance_part, len);
-        instance[len] = '\0';
-        char* p = instance;
-        while (*p && isspace(*p)) p++;
-        memmove(instance, p, strlen(p) + 1);
-        p = instance + strlen(instance) - 1;
-        while (p >= instance && isspace(*p)) *p-- = '\0';
-    }
-    if (class_part) {
-        class_part += 6;
-        char* end = strchr(class_part, ',');
-        if (!end) end = class_part + strlen(class_part);
-        int len = end - class_part;
-        if (len > (int)sizeof(class_name) - 1) len = (int)sizeof(class_name) - 1;
-        strncpy(class_name, class_part, len);
-        class_name[len] = '\0';
-        char* p = class_name;
-        while (*p && isspace(*p)) p++;
-        memmove(class_name, p, strlen(p) + 1);
-        p = class_name + strlen(class_name) - 1;
-        while (p >= class_name && isspace(*p)) *p-- = '\0';
-    }
+    parse_criterion(criteria, "instance=", instance, sizeof(instance));
+    parse_criterion(criteria, "class=", class_name, sizeof(class_name));
     if (instance[0] == '\0' && class_name[0] == '\0') {
         msg(LOG_ERR, "Window rule missing criteria: %s", first_line);
         return 0;
     }
-    if (window_rule_count >= MAX_WINDOW_RULES) {
-        msg(LOG_ERR, "Too many window rules (max %d)", MAX_WINDOW_RULES);
+    WindowRule* rule = add_window_rule(cfg);
+    if (!rule) {
+        msg(LOG_ERR, "Failed to allocate window rule");
         return 0;
     }
-    WindowRule* rule = &window_rules[window_rule_count++];
-    snprintf(rule->instance, sizeof(rule->instance), "%s", instance);
-    snprintf(rule->class_name, sizeof(rule->class_name), "%s", class_name);
+    rule->instance = arena_strdup(&cfg->arena, instance);
+    rule->class_name = arena_strdup(&cfg->arena, class_name);
+    if (!rule->instance || !rule->class_name) {
+        msg(LOG_ERR, "Failed to allocate window rule");
+        cfg->window_rule_count--;
+        return 0;
+    }
+    rule->first_binding = cfg->rule_binding_count;
     rule->binding_count = 0;
-    rule->blacklist_count = 0;  // Initialize blacklist count
+    rule->blacklist = 0;
+    rule->instance_pattern = compile_criterion(cfg, instance);
+    rule->class_pattern = compile_criterion(cfg, class_name);
+    int rule_index = cfg->window_rule_count - 1;
+    int valid = rule->instance_pattern != -2 && rule->class_pattern != -2;
     msg(LOG_NOTICE, "Created window rule for instance='%s', class='%s'",
                rule->instance, rule->class_name);
-    char line[256];
-    char trimmed_line[256];
+    char line[1024];
+    char trimmed_line[1024];
     while (fgets(line, sizeof(line), config)) {
         if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
             continue;
@@ -325,6 +446,10 @@ int parse_window_rule(FILE* config, const char* first_line) {
         if (trimmed_line[0] == '\0')
             continue;
         if (trimmed_line[0] == '}') {
+            if (!valid) {
+                drop_window_rule(cfg, rule_index, first_line);
+                return 0;
+            }
             return 1;
         }
         // Add blacklist parsing within window rule
@@ -335,19 +460,23 @@ int parse_window_rule(FILE* config, const char* first_line) {
         }
         KeyBinding binding = {0};
         if (parse_binding_line(trimmed_line, &binding)) {
-            if (rule->binding_count < MAX_BINDINGS_PER_RULE) {
-                rule->bindings[rule->binding_count++] = binding;
+            if (add_binding(cfg, &cfg->rule_bindings, &cfg->rule_binding_count,
+                            &cfg->rule_binding_capacity, &binding)) {
+                rule->binding_count++;
                 msg(LOG_NOTICE, "Added window rule binding: %s%s%s = %s",
                           get_button_name(binding.button1),
                           binding.button2 ? " & " : "",
                           binding.button2 ? get_button_name(binding.button2) : "",
                           get_action_name(&binding.action));
             } else {
-                msg(LOG_ERR, "Too many bindings for window rule (max %d)", MAX_BINDINGS_PER_RULE);
+                msg(LOG_ERR, "Failed to allocate window rule binding");
             }
         }
     }
     msg(LOG_ERR, "Missing closing brace for window rule");
+    if (!valid) {
+        drop_window_rule(cfg, rule_index, first_line);
+    }
     return 0;
 }
 
@@ -358,7 +487,7 @@ int parse_config_file(const char* filename) {
     if (!filename || strlen(filename) == 0) {
         const char* default_path = xdg_get_user_config_path(PROGRAM_NAME);
         if (!default_path) {
-            return 0;
+            return -1;
         }
         strncpy(real_path, default_path, PATH_MAX - 1);
         real_path[PATH_MAX - 1] = '\0';
@@ -366,7 +495,7 @@ int parse_config_file(const char* filename) {
         const char* home = getenv("HOME");
         if (!home) {
             msg(LOG_ERR, "Could not determine home directory");
-            return 0;
+            return -1;
         }
         snprintf(real_path, PATH_MAX, "%s%s", home, filename + 1);
     } else {
@@ -377,20 +506,28 @@ int parse_config_file(const char* filename) {
     FILE* config = fopen(real_path, "r");
     if (!config) {
         msg(LOG_ERR, "Could not open config file %s: %s", real_path, strerror(errno));
-        return 0;
+        return -1;
+    }
+
+    // The snapshot lives in its own arena
+    Arena arena = {0};
+    Config* cfg = arena_alloc(&arena, sizeof(Config));
+    if (!cfg) {
+        msg(LOG_ERR, "Failed to allocate config");
+        fclose(config);
+        return -1;
     }
+    cfg->arena = arena;
+    cfg->scroll_rate = SCROLL_RATE_DEFAULT;
 
     msg(LOG_NOTICE, "Reading configuration from %s", real_path);
 
     char line[1024];
     char trimmed_line[1024];
     char merged_line[1024] = {0};
-    binding_count = 0;
-    window_rule_count = 0;
-    device_config.device_blacklist_count = 0;
     int in_continuation = 0;
 
-    while (fgets(line, sizeof(line), config) && binding_count < MAX_BINDINGS) {
+    while (fgets(line, sizeof(line), config)) {
         
         if (!in_continuation && (line[0] == '#' || line[0] == '\n' || line[0] == '\r'))
             continue;
@@ -431,44 +568,290 @@ int parse_config_file(const char* filename) {
             continue;
 
         if (strncmp(trimmed_line, "window ", 7) == 0) {
-            parse_window_rule(config, trimmed_line);
+            parse_window_rule(cfg, config, trimmed_line);
             continue;
         }
 
         if (strncmp(trimmed_line, "device_blacklist = ", 19) == 0) {
-            parse_device_blacklist_line(trimmed_line + 19);
+            parse_device_blacklist_line(cfg, trimmed_line + 19);
+            continue;
+        }
+
+        if (strncmp(trimmed_line, "focus = ", 8) == 0) {
+            parse_focus_line(cfg, trimmed_line + 8);
+            continue;
+        }
+
+        if (strncmp(trimmed_line, "scroll_rate = ", 14) == 0) {
+            parse_scroll_rate_line(cfg, trimmed_line + 14);
             continue;
         }
 
         KeyBinding binding = {0};
 
         if (parse_binding_line(trimmed_line, &binding)) {
-            if (binding_count < MAX_BINDINGS) {
-                bindings[binding_count++] = binding;
+            if (add_binding(cfg, &cfg->bindings, &cfg->binding_count, &cfg->binding_capacity, &binding)) {
                 msg(LOG_NOTICE, "Added binding: %s%s%s = %s",
                           get_button_name(binding.button1),
                           binding.button2 ? " & " : "",
                           binding.button2 ? get_button_name(binding.button2) : "",
                           get_action_name(&binding.action));
             } else {
-                msg(LOG_ERR, "Too many bindings (max %d)", MAX_BINDINGS);
+                msg(LOG_ERR, "Failed to allocate binding");
             }
         }
     }
 
     fclose(config);
 
-    if (binding_count == 0) {
+    if (cfg->binding_count == 0) {
         msg(LOG_WARNING, "No valid bindings defined in config file %s", real_path);
     }
 
-    return binding_count;
+    if (!compile_binding_tables(cfg)) {
+        msg(LOG_ERR, "Failed to allocate binding tables");
+        destroy_config(cfg);
+        return -1;
+    }
+
+    Config* old = current_config;
+    current_config = cfg;
+    destroy_config(old);
+
+    return cfg->binding_count;
+}
+
+// The first binding for a button pair wins, as it did with the linear scan
+static void compile_binding_table(BindingTable* table, const KeyBinding* bindings, int count) {
+    memset(table, 0, sizeof(*table));
+    for (int i = 0; i < count; i++) {
+        const Action** slot = &table->actions[bindings[i].button1][bindings[i].button2];
+        if (!*slot) {
+            *slot = &bindings[i].action;
+        }
+    }
+}
+
+static uint32_t rule_hash(uint32_t instance_id, uint32_t class_id) {
+    return instance_id * 2654435761u ^ class_id * 40503u;
+}
+
+static RuleIndexEntry* rule_index_slot(const Config* cfg, uint32_t instance_id, uint32_t class_id) {
+    uint32_t mask = cfg->rule_index_size - 1;
+    uint32_t slot = rule_hash(instance_id, class_id) & mask;
+    while (cfg->rule_index[slot].first_rule >= 0) {
+        RuleIndexEntry* entry = &cfg->rule_index[slot];
+        if (entry->instance_id == instance_id && entry->class_id == class_id) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return &cfg->rule_index[slot];
+}
+
+// Rules are chained per (instance, class) key in config order. A rule
+// without instance or class is indexed with 0 there, the wildcard.
+// Rules with a glob or regex criterion go to a separate ordered list.
+static int compile_rule_index(Config* cfg) {
+    uint32_t size = 16;
+    while (size < (uint32_t)cfg->window_rule_count * 2) size *= 2;
+
+    cfg->rule_index = arena_alloc(&cfg->arena, size * sizeof(RuleIndexEntry));
+    if (!cfg->rule_index) {
+        return 0;
+    }
+    cfg->rule_index_size = size;
+    for (uint32_t i = 0; i < size; i++) {
+        cfg->rule_index[i].first_rule = -1;
+    }
+
+    cfg->pattern_rule_count = 0;
+    for (int i = 0; i < cfg->window_rule_count; i++) {
+        WindowRule* rule = &cfg->window_rules[i];
+        if (rule->instance_pattern >= 0 || rule->class_pattern >= 0) {
+            if (!arena_reserve(&cfg->arena, (void**)&cfg->pattern_rules, &cfg->pattern_rule_capacity,
+                               cfg->pattern_rule_count, sizeof(int))) {
+                return 0;
+            }
+            cfg->pattern_rules[cfg->pattern_rule_count++] = i;
+        }
+    }
+
+    for (int i = cfg->window_rule_count - 1; i >= 0; i--) {
+        WindowRule* rule = &cfg->window_rules[i];
+        rule->instance_id = rule->instance_pattern >= 0 ? INTERN_NONE : intern(rule->instance);
+        rule->class_id = rule->class_pattern >= 0 ? INTERN_NONE : intern(rule->class_name);
+        rule->next_rule = -1;
+
+        // Pattern rules are tried one by one, only once per window class
+        if (rule->instance_pattern >= 0 || rule->class_pattern >= 0) continue;
+
+        RuleIndexEntry* entry = rule_index_slot(cfg, rule->instance_id, rule->class_id);
+        rule->next_rule = entry->first_rule;
+        entry->instance_id = rule->instance_id;
+        entry->class_id = rule->class_id;
+        entry->first_rule = i;
+    }
+    return 1;
+}
+
+static int compile_binding_tables(Config* cfg) {
+    compile_binding_table(&cfg->global.table, cfg->bindings, cfg->binding_count);
+    cfg->global.blacklist = 0;
+    return compile_rule_index(cfg);
+}
+
+static int criterion_matches(const Config* cfg, int pattern, uint32_t rule_id, uint32_t id) {
+    if (pattern >= 0) {
+        return regexec(cfg->patterns[pattern], intern_name(id), 0, NULL, 0) == 0;
+    }
+    return rule_id == INTERN_NONE || rule_id == id;
+}
+
+// Next rule in the pattern list at or after *pos that matches the pair
+static int next_pattern_rule(const Config* cfg, int* pos, uint32_t instance_id, uint32_t class_id) {
+    while (*pos < cfg->pattern_rule_count) {
+        int index = cfg->pattern_rules[(*pos)++];
+        const WindowRule* rule = &cfg->window_rules[index];
+        if (criterion_matches(cfg, rule->instance_pattern, rule->instance_id, instance_id) &&
+            criterion_matches(cfg, rule->class_pattern, rule->class_id, class_id)) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+// Merge every rule that matches the pair, in config order, so the
+// first rule with a binding for a button pair still wins
+static ResolvedRules* resolve_rules(Config* cfg, uint32_t instance_id, uint32_t class_id) {
+    int pattern_pos = 0;
+    int heads[4] = {
+        rule_index_slot(cfg, instance_id, class_id)->first_rule,
+        class_id ? rule_index_slot(cfg, instance_id, 0)->first_rule : -1,
+        instance_id ? rule_index_slot(cfg, 0, class_id)->first_rule : -1,
+        next_pattern_rule(cfg, &pattern_pos, instance_id, class_id),
+    };
+
+    if (heads[0] < 0 && heads[1] < 0 && heads[2] < 0 && heads[3] < 0) {
+        return &cfg->global;
+    }
+
+    ResolvedRules* resolved = arena_alloc(&cfg->arena, sizeof(ResolvedRules));
+    if (!resolved) {
+        return &cfg->global;
+    }
+
+    for (;;) {
+        int next = -1;
+        for (int i = 0; i < 4; i++) {
+            if (heads[i] >= 0 && (next < 0 || heads[i] < heads[next])) next = i;
+        }
+        if (next < 0) break;
+
+        const WindowRule* rule = &cfg->window_rules[heads[next]];
+        heads[next] = next == 3 ? next_pattern_rule(cfg, &pattern_pos, instance_id, class_id) : rule->next_rule;
+
+        const KeyBinding* bindings = &cfg->rule_bindings[rule->first_binding];
+        for (int j = 0; j < rule->binding_count; j++) {
+            const Action** slot = &resolved->table.actions[bindings[j].button1][bindings[j].button2];
+            if (!*slot) {
+                *slot = &bindings[j].action;
+            }
+        }
+        resolved->blacklist |= rule->blacklist;
+    }
+
+    for (int b1 = 0; b1 < BINDING_TABLE_SIZE; b1++) {
+        for (int b2 = 0; b2 < BINDING_TABLE_SIZE; b2++) {
+            if (!resolved->table.actions[b1][b2]) {
+                resolved->table.actions[b1][b2] = cfg->global.table.actions[b1][b2];
+            }
+        }
+    }
+
+    return resolved;
+}
+
+static int grow_memo(Config* cfg) {
+    uint32_t capacity = cfg->memo_capacity ? cfg->memo_capacity * 2 : 64;
+    RuleMemoEntry* grown = arena_alloc(&cfg->arena, capacity * sizeof(*grown));
+    if (!grown) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < cfg->memo_capacity; i++) {
+        RuleMemoEntry* entry = &cfg->memo[i];
+        if (!entry->rules) continue;
+        uint32_t slot = rule_hash(entry->instance_id, entry->class_id) & (capacity - 1);
+        while (grown[slot].rules) slot = (slot + 1) & (capacity - 1);
+        grown[slot] = *entry;
+    }
+
+    cfg->memo = grown;
+    cfg->memo_capacity = capacity;
+    return 1;
+}
+
+// Resolved once per distinct (instance, class) pair, after that a
+// window's bindings and blacklist are one hash probe away
+static const ResolvedRules* rules_for_window(Config* cfg, uint32_t instance_id, uint32_t class_id) {
+    if (cfg->memo) {
+        uint32_t slot = rule_hash(instance_id, class_id) & (cfg->memo_capacity - 1);
+        while (cfg->memo[slot].rules) {
+            RuleMemoEntry* entry = &cfg->memo[slot];
+            if (entry->instance_id == instance_id && entry->class_id == class_id) {
+                return entry->rules;
+            }
+            slot = (slot + 1) & (cfg->memo_capacity - 1);
+        }
+    }
+
+    ResolvedRules* rules = resolve_rules(cfg, instance_id, class_id);
+
+    if ((cfg->memo_count + 1) * 2 > cfg->memo_capacity && !grow_memo(cfg)) {
+        return rules;
+    }
+
+    uint32_t slot = rule_hash(instance_id, class_id) & (cfg->memo_capacity - 1);
+    while (cfg->memo[slot].rules) slot = (slot + 1) & (cfg->memo_capacity - 1);
+    cfg->memo[slot] = (RuleMemoEntry){ instance_id, class_id, rules };
+    cfg->memo_count++;
+
+    msg(LOG_DEBUG, "Resolved window rules for instance='%s', class='%s'",
+        intern_name(instance_id), intern_name(class_id));
+    return rules;
+}
+
+static void destroy_config(Config* cfg) {
+    if (!cfg) return;
+    for (int i = 0; i < cfg->pattern_count; i++) {
+        regfree(cfg->patterns[i]);
+    }
+    // The config struct is in its own arena, copy the handle out first
+    Arena arena = cfg->arena;
+    arena_free(&arena);
+}
+
+static inline const Action* binding_table_lookup(const BindingTable* table, int first_button, int second_button) {
+    if ((unsigned int)first_button >= BINDING_TABLE_SIZE || (unsigned int)second_button >= BINDING_TABLE_SIZE) {
+        return NULL;
+    }
+    return table->actions[first_button][second_button];
+}
+
+const Config* get_config(void) {
+    return current_config;
 }
 
-static void parse_device_blacklist_line(const char* blacklist_str) {
+void free_config(void) {
+    destroy_config(current_config);
+    current_config = NULL;
+}
+
+static void parse_device_blacklist_line(Config* cfg, const char* blacklist_str) {
     char* token_start = (char*)blacklist_str;
     
-    while (*token_start && device_config.device_blacklist_count < MAX_DEVICE_BLACKLIST) {
+    while (*token_start) {
         while (*token_start && (isspace(*token_start) || *token_start == ',')) {
             token_start++;
         }
@@ -480,93 +863,108 @@ static void parse_device_blacklist_line(const char* blacklist_str) {
             token_end++;
         }
         
-        char device_name[MAX_DEVICE_NAME_LENGTH] = {0};
-        int len = token_end - token_start;
-        if (len >= MAX_DEVICE_NAME_LENGTH) len = MAX_DEVICE_NAME_LENGTH - 1;
-        strncpy(device_name, token_start, len);
-        device_name[len] = '\0';
-        
-        snprintf(device_config.blacklisted_devices[device_config.device_blacklist_count], 
-                 MAX_DEVICE_NAME_LENGTH, "%s", device_name);
-        device_config.device_blacklist_count++;
+        char* device_name = strndup(token_start, token_end - token_start);
+        if (!device_name ||
+            !arena_reserve(&cfg->arena, (void**)&cfg->blacklisted_devices, &cfg->device_blacklist_capacity,
+                           cfg->device_blacklist_count, sizeof(char*)) ||
+            !(cfg->blacklisted_devices[cfg->device_blacklist_count] = arena_strdup(&cfg->arena, device_name))) {
+            msg(LOG_ERR, "Failed to allocate device blacklist entry");
+            free(device_name);
+            return;
+        }
+        cfg->device_blacklist_count++;
         
         msg(LOG_NOTICE, "Added device to blacklist: %s", device_name);
+        free(device_name);
         
         token_start = token_end;
     }
 }
 
+static void parse_focus_line(Config* cfg, const char* policy) {
+    char value[32] = {0};
+    sscanf(policy, "%31s", value);
+
+    if (strcmp(value, "change") == 0) {
+        cfg->focus_policy = FOCUS_CHANGE;
+    } else if (strcmp(value, "always") == 0) {
+        cfg->focus_policy = FOCUS_ALWAYS;
+    } else if (strcmp(value, "never") == 0) {
+        cfg->focus_policy = FOCUS_NEVER;
+    } else {
+        msg(LOG_ERR, "Unknown focus policy: %s (use change, always or never)", policy);
+        return;
+    }
+    msg(LOG_NOTICE, "Focus policy: %s", value);
+}
+
+FocusPolicy get_focus_policy(void) {
+    return current_config ? current_config->focus_policy : FOCUS_CHANGE;
+}
+
+static void parse_scroll_rate_line(Config* cfg, const char* rate) {
+    int value;
+    if (sscanf(rate, "%d", &value) != 1 || value < 0) {
+        msg(LOG_ERR, "Invalid scroll rate: %s (use actions per second, 0 for no limit)", rate);
+        return;
+    }
+    cfg->scroll_rate = value;
+    msg(LOG_NOTICE, "Scroll rate: %d per second", value);
+}
+
+int get_scroll_rate(void) {
+    return current_config ? current_config->scroll_rate : SCROLL_RATE_DEFAULT;
+}
+
 int is_device_blacklisted(const char* device_name) {
-   for (int i = 0; i < device_config.device_blacklist_count; i++) {
-       if (strstr(device_name, device_config.blacklisted_devices[i])) {
+   const Config* cfg = current_config;
+   if (!cfg) return 0;
+   for (int i = 0; i < cfg->device_blacklist_count; i++) {
+       if (strstr(device_name, cfg->blacklisted_devices[i])) {
            return 1;
        }
    }
    return 0;
 }
 
-int is_button_blacklisted(const char* instance, const char* class_name, int button) {
-    for (int i = 0; i < window_rule_count; i++) {
-        WindowRule* rule = &window_rules[i];
-        int match = 1;
-        
-        if (rule->instance[0] && strcmp(rule->instance, instance) != 0) {
-            match = 0;
-        }
-        if (rule->class_name[0] && strcmp(rule->class_name, class_name) != 0) {
-            match = 0;
-        }
-        
-        if (match) {
-            for (int j = 0; j < rule->blacklist_count; j++) {
-                if (rule->blacklisted_buttons[j] == button) {
-                    return 1;
-                }
-            }
-        }
-    }
-    return 0;
+int is_button_blacklisted(uint32_t instance, uint32_t class_name, int button) {
+    Config* cfg = current_config;
+    if (!cfg || (unsigned int)button >= BINDING_TABLE_SIZE) return 0;
+    return (rules_for_window(cfg, instance, class_name)->blacklist >> button) & 1;
 }
 
 const Action* get_action_for_buttons(int first_button, int second_button) {
-    for (int i = 0; i < binding_count; i++) {
-        if (second_button > 0) {
-            if (bindings[i].button1 == first_button && bindings[i].button2 == second_button) {
-                return &bindings[i].action;
-            }
-        }
-        else if (bindings[i].button1 == first_button && bindings[i].button2 == 0) {
-            return &bindings[i].action;
-        }
-    }
-    return NULL;
+    const Config* cfg = current_config;
+    if (!cfg) return NULL;
+    return binding_table_lookup(&cfg->global.table, first_button, second_button);
 }
 
-const Action* get_action_for_window(const char* instance, const char* class_name,
+const Action* get_action_for_window(uint32_t instance, uint32_t class_name,
                                    int first_button, int second_button) {
-    for (int i = 0; i < window_rule_count; i++) {
-        WindowRule* rule = &window_rules[i];
-        int match = 1;
-        if (rule->instance[0] && strcmp(rule->instance, instance) != 0) {
-            match = 0;
-        }
-        if (rule->class_name[0] && strcmp(rule->class_name, class_name) != 0) {
-            match = 0;
-        }
-        if (match) {
-            for (int j = 0; j < rule->binding_count; j++) {
-                if (second_button > 0) {
-                    if (rule->bindings[j].button1 == first_button &&
-                        rule->bindings[j].button2 == second_button) {
-                        return &rule->bindings[j].action;
-                    }
-                }
-                else if (rule->bindings[j].button1 == first_button &&
-                         rule->bindings[j].button2 == 0) {
-                    return &rule->bindings[j].action;
-                }
-            }
-        }
+    Config* cfg = current_config;
+    if (!cfg) return NULL;
+    return binding_table_lookup(&rules_for_window(cfg, instance, class_name)->table, first_button, second_button);
+}
+
+static int add_action_key(unsigned int* keys, int count, int max_keys, unsigned int key) {
+    for (int i = 0; i < count && i < max_keys; i++) {
+        if (keys[i] == key) return count;
+    }
+    if (count < max_keys) {
+        keys[count] = key;
+    }
+    return count + 1;
+}
+
+int collect_action_keys(unsigned int* keys, int max_keys) {
+    const Config* cfg = current_config;
+    int count = 0;
+    if (!cfg) return 0;
+    for (int i = 0; i < cfg->binding_count; i++) {
+        count = add_action_key(keys, count, max_keys, cfg->bindings[i].action.key);
+    }
+    for (int i = 0; i < cfg->rule_binding_count; i++) {
+        count = add_action_key(keys, count, max_keys, cfg->rule_bindings[i].action.key);
     }
-    return get_action_for_buttons(first_button, second_button);
+    return count;
 }
@@ -1,26 +1,17 @@
 #pragma once
 
 #include <xcb/xcb.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <limits.h>
+#include <regex.h>
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
-#define MAX_BINDINGS 10
-#define MAX_BUTTONS_PER_RULE 3
-#define MAX_WINDOW_RULES 20
-#define MAX_BINDINGS_PER_RULE 20
+#include "arena.h"
 
-#define MAX_DEVICE_BLACKLIST 10
-#define MAX_DEVICE_NAME_LENGTH 64
-
-typedef struct {
-    char blacklisted_devices[MAX_DEVICE_BLACKLIST][MAX_DEVICE_NAME_LENGTH];
-    int device_blacklist_count;
-} DeviceConfig;
-
-extern DeviceConfig device_config;
+#define BINDING_TABLE_SIZE 16
 
 typedef struct {
     unsigned int modifiers;
@@ -33,19 +24,98 @@ typedef struct {
     Action action;
 } KeyBinding;
 
+// Direct-indexed [button1][button2] table, button2 is 0 for a single
+// button binding. Compiled from the parsed bindings, NULL where unbound.
 typedef struct {
-    char instance[128];
-    char class_name[128];
-    KeyBinding bindings[MAX_BINDINGS_PER_RULE];
+    const Action* actions[BINDING_TABLE_SIZE][BINDING_TABLE_SIZE];
+} BindingTable;
+
+typedef struct {
+    const char* instance;   // "" matches any instance
+    const char* class_name; // "" matches any class
+    uint32_t instance_id;
+    uint32_t class_id;
+    int instance_pattern;   // into Config.patterns, -1 for an exact name
+    int class_pattern;
+    int first_binding;      // into Config.rule_bindings
     int binding_count;
-    int blacklisted_buttons[MAX_BUTTONS_PER_RULE];
-    int blacklist_count;
+    uint32_t blacklist;     // bit per blacklisted button
+    int next_rule;          // next rule with the same ids, -1 at the end
 } WindowRule;
 
+// Everything that applies to one (instance, class) pair: the bindings of
+// all matching rules merged over the global ones, and a bit per
+// blacklisted button
+typedef struct {
+    BindingTable table;
+    uint32_t blacklist;
+} ResolvedRules;
+
+typedef struct {
+    uint32_t instance_id;
+    uint32_t class_id;
+    int first_rule;
+} RuleIndexEntry;
+
+typedef struct {
+    uint32_t instance_id;
+    uint32_t class_id;
+    ResolvedRules* rules;
+} RuleMemoEntry;
+
+// When a shortcut moves the input focus to the window under the pointer
+typedef enum {
+    FOCUS_CHANGE,   // only when the active window differs (default)
+    FOCUS_ALWAYS,   // before every shortcut
+    FOCUS_NEVER,    // leave focus to the window manager
+} FocusPolicy;
+
+// Wheel actions a binding may fire per second, 0 for no limit
+#define SCROLL_RATE_DEFAULT 20
+
+// One parsed config snapshot. The struct and every array it points to
+// live in its arena, so there are no fixed limits and the whole snapshot
+// is released with one arena_free(). Rule bindings are stored back to
+// back in rule order.
+typedef struct {
+    Arena arena;
+    KeyBinding* bindings;
+    int binding_count;
+    int binding_capacity;
+    WindowRule* window_rules;
+    int window_rule_count;
+    int window_rule_capacity;
+    KeyBinding* rule_bindings;
+    int rule_binding_count;
+    int rule_binding_capacity;
+    regex_t** patterns;
+    int pattern_count;
+    int pattern_capacity;
+    int* pattern_rules;     // rules with a pattern criterion, in config order
+    int pattern_rule_count;
+    int pattern_rule_capacity;
+    char** blacklisted_devices;
+    int device_blacklist_count;
+    int device_blacklist_capacity;
+    FocusPolicy focus_policy;
+    int scroll_rate;
+    ResolvedRules global;
+    RuleIndexEntry* rule_index;
+    uint32_t rule_index_size;
+    RuleMemoEntry* memo;
+    uint32_t memo_count;
+    uint32_t memo_capacity;
+} Config;
+
 int           parse_config_file(const char* filename);
+void          free_config(void);
+const Config* get_config(void);
 const char*   get_action_name(const Action* combo);
 const char*   get_button_name(int button);
 const Action* get_action_for_buttons(int first_button, int second_button);
-const Action* get_action_for_window(const char* instance, const char* class_name, int first_button, int second_button);
-int           is_button_blacklisted(const char* instance, const char* class_name, int button);
+const Action* get_action_for_window(uint32_t instance, uint32_t class_name, int first_button, int second_button);
+int           is_button_blacklisted(uint32_t instance, uint32_t class_name, int button);
 int           is_device_blacklisted(const char* device_name);
+FocusPolicy   get_focus_policy(void);
+int           get_scroll_rate(void);
+int           collect_action_keys(unsigned int* keys, int max_keys);
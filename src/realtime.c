@@ -0,0 +1,105 @@
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <errno.h>
+
+#include "realtime.h"
+#include "window.h"
+#include "eeka.h"
+
+// Opt-in --realtime mode for loaded machines. The event loop only ever
+// waits on epoll and never does much per wakeup, so real-time priority
+// costs the rest of the system nothing while it keeps compiles from
+// delaying mouse events. Every step is best effort: one that is not
+// permitted is logged and the daemon carries on with the rest.
+
+static int set_scheduling(void) {
+    struct sched_param param = { .sched_priority = REALTIME_PRIORITY };
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err == 0) {
+        msg(LOG_NOTICE, "Real-time: SCHED_FIFO priority %d", REALTIME_PRIORITY);
+        return 0;
+    }
+    msg(LOG_WARNING, "Real-time: SCHED_FIFO refused: %s", strerror(err));
+
+    // On Linux a nice value set for process 0 only applies to the thread
+    if (setpriority(PRIO_PROCESS, 0, REALTIME_NICE) == 0) {
+        msg(LOG_NOTICE, "Real-time: nice %d instead", REALTIME_NICE);
+        return 0;
+    }
+    msg(LOG_WARNING, "Real-time: nice %d refused: %s", REALTIME_NICE, strerror(errno));
+    return -1;
+}
+
+static int pin_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        msg(LOG_WARNING, "Real-time: cannot pin to CPU %d: %s", cpu, strerror(err));
+        return -1;
+    }
+    msg(LOG_NOTICE, "Real-time: pinned to CPU %d", cpu);
+    return 0;
+}
+
+static void prefault_stack(void) {
+    volatile char stack[REALTIME_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+// Devices, the config snapshot and the evdev, uinput and record buffers
+// are fixed size already. What the loop still allocates is libxcb's
+// replies, freed right after, and the top-level window list.
+static int preallocate(void) {
+    int failed = 0;
+
+    // Keep freed memory in the heap, and out of fresh mmap() chunks, so
+    // reply buffers are reused from pages mlockall() already locked
+    if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0)) {
+        failed = 1;
+    }
+    if (window_reserve_toplevels(REALTIME_TOPLEVELS) < 0) {
+        failed = 1;
+    }
+    prefault_stack();
+
+    if (failed) {
+        msg(LOG_WARNING, "Real-time: buffers only partly preallocated");
+        return -1;
+    }
+    msg(LOG_NOTICE, "Real-time: buffers preallocated, %d KiB of stack touched",
+        REALTIME_STACK_PREFAULT / 1024);
+    return 0;
+}
+
+static int lock_memory(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        msg(LOG_WARNING, "Real-time: mlockall refused: %s", strerror(errno));
+        return -1;
+    }
+    msg(LOG_NOTICE, "Real-time: memory locked");
+    return 0;
+}
+
+int realtime_enable(int cpu) {
+    int failed = 0;
+
+    if (preallocate() < 0) failed++;
+    if (lock_memory() < 0) failed++;
+    if (cpu >= 0 && pin_cpu(cpu) < 0) failed++;
+    if (set_scheduling() < 0) failed++;
+
+    if (failed) {
+        msg(LOG_WARNING, "Real-time mode: %d step(s) failed", failed);
+    } else {
+        msg(LOG_NOTICE, "Real-time mode enabled");
+    }
+    return failed;
+}
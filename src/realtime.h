@@ -0,0 +1,20 @@
+#pragma once
+
+// SCHED_FIFO priority for --realtime, below the threaded IRQ handlers'
+// default of 50 so the input drivers themselves are never starved
+#define REALTIME_PRIORITY 20
+
+// Nice value tried when SCHED_FIFO is not permitted
+#define REALTIME_NICE -10
+
+// Stack touched up front so the loop never faults a new stack page
+#define REALTIME_STACK_PREFAULT (256 * 1024)
+
+// Top-level windows reserved in the pointer tracking list
+#define REALTIME_TOPLEVELS 1024
+
+// Applies --realtime to the calling thread: scheduling, CPU pinning
+// (cpu < 0 leaves affinity alone), preallocation and mlockall. Each step
+// is logged with its outcome; returns how many of them failed. Threads
+// created afterwards inherit the scheduling and affinity.
+int realtime_enable(int cpu);
@@ -0,0 +1,282 @@
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "record.h"
+#include "intern.h"
+#include "latency.h"
+
+// Entries collect in one of two static buffers. A full one, or the
+// current one when the main loop goes idle, is handed to a writer
+// thread and the loop goes on with the other, so recording costs a copy
+// per event and no write() on the loop. Should the current buffer fill
+// while the writer is still busy with the other, say on a slow disk,
+// entries are dropped and counted rather than waited for.
+
+int record_fd = -1;
+
+static RecordEntry buffers[2][RECORD_BUFFER_SIZE];
+static int current = 0;
+static int buffer_len = 0;
+static unsigned long dropped = 0;
+
+// The loop hands a buffer over by storing its length with release
+// ordering, the writer gives it back by storing 0 the same way
+static int writing = 0;
+static int writing_len = 0;
+static int write_error = 0;
+static int stopping = 0;
+
+static pthread_t writer_thread;
+static int thread_running = 0;
+static int wake_fd = -1;
+
+// Interned ids already defined in this session
+static uint8_t* names_written = NULL;
+static uint32_t names_capacity = 0;
+
+// Entries buffered and not handed to the writer yet
+int record_pending(void) {
+    return record_fd >= 0 && buffer_len > 0;
+}
+
+// 0 or the errno of the failed write
+static int write_entries(const RecordEntry* entries, int count) {
+    const char* data = (const char*)entries;
+    size_t left = count * sizeof(RecordEntry);
+    while (left > 0) {
+        ssize_t bytes = write(record_fd, data, left);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        data += bytes;
+        left -= bytes;
+    }
+    return 0;
+}
+
+static void* writer_main(void* arg) {
+    (void)arg;
+
+    for (;;) {
+        int len = __atomic_load_n(&writing_len, __ATOMIC_ACQUIRE);
+        if (len == 0) {
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) break;
+
+            uint64_t wakeups;
+            if (read(wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EINTR) {
+                __atomic_store_n(&write_error, errno, __ATOMIC_RELEASE);
+                break;
+            }
+            continue;
+        }
+
+        int err = write_entries(buffers[writing], len);
+        if (err != 0) {
+            __atomic_store_n(&write_error, err, __ATOMIC_RELEASE);
+            break;
+        }
+        __atomic_store_n(&writing_len, 0, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void stop_writer(void) {
+    if (!thread_running) return;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        msg(LOG_ERR, "Cannot wake the trace writer: %s", strerror(errno));
+    }
+    pthread_join(writer_thread, NULL);
+    thread_running = 0;
+    __atomic_store_n(&stopping, 0, __ATOMIC_RELAXED);
+}
+
+// The writer failed and is gone, recording ends here
+static int writer_failed(void) {
+    int err = __atomic_load_n(&write_error, __ATOMIC_ACQUIRE);
+    if (err == 0) return 0;
+
+    msg(LOG_ERR, "Cannot write trace, recording stopped: %s", strerror(err));
+    stop_writer();
+    close(record_fd);
+    record_fd = -1;
+    __atomic_store_n(&write_error, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Gives the current buffer to the writer; 0 while it still has the other
+static int hand_off(void) {
+    if (writer_failed()) return 0;
+    if (__atomic_load_n(&writing_len, __ATOMIC_ACQUIRE) != 0) return 0;
+
+    writing = current;
+    __atomic_store_n(&writing_len, buffer_len, __ATOMIC_RELEASE);
+    current = 1 - current;
+    buffer_len = 0;
+
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        msg(LOG_ERR, "Cannot wake the trace writer: %s", strerror(errno));
+    }
+    if (dropped > 0) {
+        msg(LOG_WARNING, "Trace writes fell behind, %lu entries dropped", dropped);
+        dropped = 0;
+    }
+    return 1;
+}
+
+void record_flush(void) {
+    if (record_fd < 0 || buffer_len == 0) return;
+    hand_off();
+}
+
+static RecordEntry* reserve_entries(int count) {
+    if (buffer_len + count > RECORD_BUFFER_SIZE && !hand_off()) {
+        if (record_fd >= 0) dropped += count;
+        return NULL;
+    }
+    RecordEntry* entry = &buffers[current][buffer_len];
+    memset(entry, 0, count * sizeof(RecordEntry));
+    buffer_len += count;
+    return entry;
+}
+
+// 0 when the definition had to be dropped
+static int record_name(uint32_t id) {
+    if (id == INTERN_NONE) return 1;
+
+    if (id >= names_capacity) {
+        uint32_t capacity = names_capacity ? names_capacity : 64;
+        while (capacity <= id) capacity *= 2;
+        uint8_t* grown = realloc(names_written, capacity);
+        if (!grown) return 0;
+        memset(grown + names_capacity, 0, capacity - names_capacity);
+        names_written = grown;
+        names_capacity = capacity;
+    }
+    if (names_written[id]) return 1;
+
+    const char* name = intern_name(id);
+    size_t len = strlen(name);
+    RecordEntry* entry = reserve_entries(1 + RECORD_NAME_ENTRIES(len));
+    if (!entry) return 0;
+
+    entry->kind = RECORD_NAME;
+    entry->instance = id;
+    entry->value = len;
+    memcpy(entry + 1, name, len);
+    names_written[id] = 1;
+    return 1;
+}
+
+int record_open(const char* path) {
+    record_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (record_fd < 0) {
+        msg(LOG_ERR, "Cannot open trace %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (lseek(record_fd, 0, SEEK_END) == 0) {
+        RecordHeader header = { .version = RECORD_VERSION, .entry_size = sizeof(RecordEntry) };
+        memcpy(header.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+        if (write(record_fd, &header, sizeof(header)) != sizeof(header)) {
+            msg(LOG_ERR, "Cannot write trace header to %s", path);
+            close(record_fd);
+            record_fd = -1;
+            return -1;
+        }
+    }
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        msg(LOG_ERR, "Cannot create the trace writer's eventfd: %s", strerror(errno));
+        close(record_fd);
+        record_fd = -1;
+        return -1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RECORD_STACK_SIZE);
+    int err = pthread_create(&writer_thread, &attr, writer_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        msg(LOG_ERR, "Cannot start the trace writer: %s", strerror(err));
+        close(wake_fd);
+        wake_fd = -1;
+        close(record_fd);
+        record_fd = -1;
+        return -1;
+    }
+    thread_running = 1;
+
+    RecordEntry* session = reserve_entries(1);
+    session->kind = RECORD_SESSION;
+    session->time_ns = latency_now();
+
+    msg(LOG_NOTICE, "Recording input to %s", path);
+    return 0;
+}
+
+// The writer finishes the buffer it has, the rest is written here
+void record_close(void) {
+    stop_writer();
+    if (record_fd >= 0 && !writer_failed()) {
+        int err = write_entries(buffers[current], buffer_len);
+        if (err != 0) {
+            msg(LOG_ERR, "Cannot write trace: %s", strerror(err));
+        }
+        if (dropped > 0) {
+            msg(LOG_WARNING, "Trace writes fell behind, %lu entries dropped", dropped);
+        }
+    }
+    buffer_len = 0;
+    dropped = 0;
+    __atomic_store_n(&writing_len, 0, __ATOMIC_RELAXED);
+    if (record_fd >= 0) {
+        close(record_fd);
+        record_fd = -1;
+    }
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    free(names_written);
+    names_written = NULL;
+    names_capacity = 0;
+}
+
+void record_event(const struct input_event* ev, int mouse, const WindowClassInfo* info,
+                  int decision, uint64_t process_ns) {
+    if (record_fd < 0) return;
+
+    uint32_t instance = info->valid ? info->instance : INTERN_NONE;
+    uint32_t class_name = info->valid ? info->class_name : INTERN_NONE;
+    // An event naming a window the trace never defined would be unreadable
+    if (!record_name(instance) || !record_name(class_name)) {
+        dropped++;
+        return;
+    }
+
+    RecordEntry* entry = reserve_entries(1);
+    if (!entry) return;
+
+    entry->time_ns = latency_event_time(ev);
+    entry->type = ev->type;
+    entry->code = ev->code;
+    entry->value = ev->value;
+    entry->instance = instance;
+    entry->class_name = class_name;
+    entry->process_ns = process_ns > UINT32_MAX ? UINT32_MAX : (uint32_t)process_ns;
+    entry->kind = RECORD_EVENT;
+    entry->decision = decision;
+    entry->mouse = mouse;
+}
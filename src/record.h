@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <linux/input.h>
+
+#include "eeka.h"
+
+// Trace written by --record: a RecordHeader, then fixed size entries
+// that can be walked in place after mmap(). Every run appends an
+// RECORD_SESSION entry, window names are numbered per session and
+// defined by a RECORD_NAME entry before their first use.
+
+#define RECORD_MAGIC   "EEKAREC"
+#define RECORD_VERSION 1
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint8_t  reserved[16];
+} RecordHeader;
+
+enum { RECORD_EVENT, RECORD_NAME, RECORD_SESSION };
+
+// Decision bits, an event with neither was blocked
+#define RECORD_FORWARDED 0x01
+#define RECORD_ACTION    0x02
+
+typedef struct {
+    uint64_t time_ns;       // kernel timestamp, CLOCK_MONOTONIC
+    uint16_t type;
+    uint16_t code;
+    int32_t  value;         // RECORD_NAME: length of the name
+    uint32_t instance;      // RECORD_NAME: the id being defined
+    uint32_t class_name;    // 0 when no window was resolved
+    uint32_t process_ns;    // time spent on this event
+    uint8_t  kind;
+    uint8_t  decision;
+    uint8_t  mouse;         // slot in mice[]
+    uint8_t  reserved;
+} RecordEntry;
+
+// A RECORD_NAME entry is followed by the name bytes, padded to whole entries
+#define RECORD_NAME_ENTRIES(len) (((len) + sizeof(RecordEntry) - 1) / sizeof(RecordEntry))
+
+#define RECORD_BUFFER_SIZE 1024
+
+// The writer thread only runs write()
+#define RECORD_STACK_SIZE (64 * 1024)
+
+extern int record_fd;
+
+int  record_open(const char* path);
+void record_close(void);
+void record_event(const struct input_event* ev, int mouse, const WindowClassInfo* info,
+                  int decision, uint64_t process_ns);
+void record_flush(void);
+int  record_pending(void);
@@ -0,0 +1,137 @@
+#include <string.h>
+
+#include "scroll.h"
+#include "latency.h"
+#include "eeka.h"
+
+// Wheel ticks that hit a binding are not sent one by one: they collect
+// on the binding and go out as one action repeating the key, at the end
+// of the evdev read they came in or, when the binding has used up its
+// token bucket, as soon as a token is back. A free-spinning wheel thus
+// costs at most scroll_rate actions per second instead of a chord per
+// tick.
+//
+// Buckets are keyed by the Action in the config snapshot, which is the
+// same for a binding whatever window it was resolved for, and are
+// cleared on reload along with the snapshot.
+
+typedef struct {
+    const Action* action;
+    xcb_window_t window;    // where the latest tick went
+    int pending;
+    int held;               // pending ticks had to wait for a token
+    uint64_t origin;        // kernel time of the latest tick
+    uint64_t credit_ns;     // an action costs one period
+    uint64_t refilled;
+} ScrollBucket;
+
+static ScrollBucket buckets[SCROLL_BUCKETS];
+
+static uint64_t period_ns(void) {
+    int rate = get_scroll_rate();
+    return rate > 0 ? 1000000000ull / rate : 0;
+}
+
+static ScrollBucket* find_bucket(const Action* action) {
+    uint64_t burst = SCROLL_BURST * period_ns();
+    uint64_t now = latency_now();
+    ScrollBucket* idle = NULL;
+
+    for (int i = 0; i < SCROLL_BUCKETS; i++) {
+        ScrollBucket* bucket = &buckets[i];
+        if (bucket->action == action) return bucket;
+        // Credit only refills in scroll_flush(), so a bucket limits nothing
+        // any more only once it would be back to a full burst by now
+        if (!idle && bucket->pending == 0 && bucket->credit_ns + (now - bucket->refilled) >= burst) {
+            idle = bucket;
+        }
+    }
+    if (!idle) return NULL;
+
+    *idle = (ScrollBucket){
+        .action = action,
+        .credit_ns = burst,
+        .refilled = now,
+    };
+    return idle;
+}
+
+// Ticks that waited for a token are sent as if their event came now:
+// the wait is the limiter's doing, and counting it would make the
+// injector drop them as stale once a period exceeds its deadline
+static void send_pending(ScrollBucket* bucket, ScrollSender send, uint64_t now) {
+    int repeat = bucket->pending;
+    if (repeat > SCROLL_REPEAT_MAX) {
+        msg(LOG_DEBUG, "Dropping %d wheel ticks of %s", repeat - SCROLL_REPEAT_MAX,
+            get_action_name(bucket->action));
+        repeat = SCROLL_REPEAT_MAX;
+    }
+    uint64_t origin = bucket->held ? now : bucket->origin;
+    bucket->pending = 0;
+    bucket->held = 0;
+    send(bucket->action, bucket->window, repeat, origin);
+}
+
+// Queues wheel ticks on their binding; 0 when every bucket holds ticks
+// of another binding and the caller should send them unlimited
+int scroll_add(const Action* action, xcb_window_t window, int ticks, uint64_t origin) {
+    ScrollBucket* bucket = find_bucket(action);
+    if (!bucket) {
+        msg(LOG_DEBUG, "No scroll bucket free for %s", get_action_name(action));
+        return 0;
+    }
+
+    bucket->window = window;
+    bucket->pending += ticks;
+    bucket->origin = origin;
+    return 1;
+}
+
+// Sends what the buckets allow; returns the milliseconds until the next
+// token for a binding still holding ticks, or -1 when none is
+int scroll_flush(ScrollSender send) {
+    uint64_t period = period_ns();
+    uint64_t now = latency_now();
+    uint64_t wait = UINT64_MAX;
+
+    for (int i = 0; i < SCROLL_BUCKETS; i++) {
+        ScrollBucket* bucket = &buckets[i];
+        if (bucket->pending == 0) continue;
+
+        if (period == 0) {
+            send_pending(bucket, send, now);
+            continue;
+        }
+
+        bucket->credit_ns += now - bucket->refilled;
+        if (bucket->credit_ns > SCROLL_BURST * period) {
+            bucket->credit_ns = SCROLL_BURST * period;
+        }
+        bucket->refilled = now;
+
+        if (bucket->credit_ns >= period) {
+            bucket->credit_ns -= period;
+            send_pending(bucket, send, now);
+            continue;
+        }
+        bucket->held = 1;
+        if (period - bucket->credit_ns < wait) {
+            wait = period - bucket->credit_ns;
+        }
+    }
+
+    if (wait == UINT64_MAX) return -1;
+    return (int)((wait + 999999) / 1000000);
+}
+
+// Whether any binding holds ticks that still have to go out
+int scroll_pending(void) {
+    for (int i = 0; i < SCROLL_BUCKETS; i++) {
+        if (buckets[i].pending > 0) return 1;
+    }
+    return 0;
+}
+
+void scroll_reset(void) {
+    memset(buckets, 0, sizeof(buckets));
+}
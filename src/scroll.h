@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <xcb/xcb.h>
+
+#include "parser.h"
+
+// Wheel bindings limited at once, ticks of any further one go out unlimited
+#define SCROLL_BUCKETS 16
+
+// Ticks sent by one action at most, the rest of a burst is dropped
+#define SCROLL_REPEAT_MAX 8
+
+// Actions a binding may fire back to back before scroll_rate applies
+#define SCROLL_BURST 4
+
+typedef void (*ScrollSender)(const Action* action, xcb_window_t window, int repeat, uint64_t origin);
+
+int  scroll_add(const Action* action, xcb_window_t window, int ticks, uint64_t origin);
+int  scroll_flush(ScrollSender send);
+int  scroll_pending(void);
+void scroll_reset(void);
@@ -0,0 +1,620 @@
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xcbext.h>
+
+#include "window.h"
+#include "eeka.h"
+#include "intern.h"
+#include "latency.h"
+
+// Direct-mapped cache of window properties, keyed by xcb_window_t.
+// Entries are filled on first lookup and invalidated from the X event
+// stream (PropertyNotify for WM_CLASS, DestroyNotify), so repeated
+// lookups on the same window cost no round trips.
+static WindowCacheEntry window_cache[WINDOW_CACHE_SIZE];
+
+// The active window as published by the window manager in
+// _NET_ACTIVE_WINDOW on the root. A change is only noted when its
+// PropertyNotify arrives; the new value is requested right away and the
+// reply read the next time it is needed, so tracking costs no round trip.
+static xcb_connection_t *focus_conn = NULL;
+static xcb_atom_t net_active_window = XCB_NONE;
+static xcb_window_t active_window = XCB_NONE;
+static xcb_get_property_cookie_t active_cookie;
+static int active_pending = 0;
+
+// Events we select on every window we watch. Enter and leave are only
+// acted on for top-level windows, the root children, which are kept in
+// an unsorted list since crossing events are rare.
+#define WATCH_EVENT_MASK (XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY | \
+                          XCB_EVENT_MASK_ENTER_WINDOW | XCB_EVENT_MASK_LEAVE_WINDOW)
+
+static uint32_t root_event_mask = 0;
+static xcb_window_t* toplevels = NULL;
+static int toplevel_count = 0;
+static int toplevel_capacity = 0;
+
+// ICCCM has the window manager put WM_STATE on client windows only, so
+// it marks the window to take WM_CLASS from below any number of frames
+static xcb_atom_t wm_state = XCB_NONE;
+
+// Bounds on the search for it below a top-level
+#define CLIENT_SEARCH_DEPTH 4
+#define CLIENT_SEARCH_WIDTH 32
+
+// The lookup of the client under the pointer and its WM_CLASS. Each step
+// sends all of its requests at once and the replies are picked up as
+// they arrive with xcb_poll_for_reply(), so the caller keeps handling
+// other input meanwhile; nothing here ever waits for X. One lookup runs
+// at a time.
+enum { LOOKUP_IDLE, LOOKUP_POINTER, LOOKUP_CLIENT, LOOKUP_CLASS };
+
+// WM_STATE, WM_CLASS and the children of each window searched
+#define LOOKUP_REPLIES 3
+
+static struct {
+    int step;
+    int depth;
+    int count;          // windows on the level searched
+    int sent;           // requests of the step
+    int received;       // their replies in so far
+    int queried;
+    uint64_t start;
+    xcb_window_t frame;
+    xcb_window_t level[CLIENT_SEARCH_WIDTH];
+    unsigned int sequences[CLIENT_SEARCH_WIDTH * LOOKUP_REPLIES];
+    void *replies[CLIENT_SEARCH_WIDTH * LOOKUP_REPLIES];
+    WindowClassInfo frame_info;
+    WindowTarget result;
+} lookup;
+
+// The top-level under the pointer, XCB_NONE over the root
+static xcb_window_t pointer_toplevel = XCB_NONE;
+static int pointer_known = 0;
+
+static void watch_window(xcb_connection_t *conn, xcb_window_t window) {
+    const uint32_t mask = WATCH_EVENT_MASK;
+    xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK, &mask);
+}
+
+static xcb_atom_t intern_atom(xcb_connection_t *conn, const char *name, int only_if_exists) {
+    xcb_atom_t atom = XCB_NONE;
+    xcb_intern_atom_cookie_t cookie = xcb_intern_atom(conn, only_if_exists, strlen(name), name);
+    xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(conn, cookie, NULL);
+    if (reply) {
+        atom = reply->atom;
+        free(reply);
+    }
+    return atom;
+}
+
+static void lookup_free_replies(void) {
+    for (int i = 0; i < lookup.sent; i++) {
+        free(lookup.replies[i]);
+        lookup.replies[i] = NULL;
+    }
+    lookup.sent = lookup.received = 0;
+}
+
+static void select_root_events(xcb_connection_t *conn, uint32_t mask) {
+    root_event_mask |= mask;
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK, &root_event_mask);
+}
+
+static int find_toplevel(xcb_window_t window) {
+    for (int i = 0; i < toplevel_count; i++) {
+        if (toplevels[i] == window) return i;
+    }
+    return -1;
+}
+
+int window_reserve_toplevels(int capacity) {
+    if (capacity <= toplevel_capacity) return 0;
+
+    xcb_window_t* grown = realloc(toplevels, capacity * sizeof(*grown));
+    if (!grown) return -1;
+    toplevels = grown;
+    toplevel_capacity = capacity;
+    return 0;
+}
+
+static void add_toplevel(xcb_connection_t *conn, xcb_window_t window) {
+    if (find_toplevel(window) >= 0) return;
+
+    if (toplevel_count == toplevel_capacity &&
+        window_reserve_toplevels(toplevel_capacity ? toplevel_capacity * 2 : 64) < 0) {
+        return;
+    }
+    toplevels[toplevel_count++] = window;
+    watch_window(conn, window);
+}
+
+static void remove_toplevel(xcb_window_t window) {
+    int index = find_toplevel(window);
+    if (index >= 0) {
+        toplevels[index] = toplevels[--toplevel_count];
+    }
+    if (window == pointer_toplevel) {
+        pointer_known = 0;
+    }
+}
+
+static void request_active_window(void) {
+    if (active_pending) {
+        xcb_discard_reply(focus_conn, active_cookie.sequence);
+    }
+    active_cookie = xcb_get_property(focus_conn, 0, screen->root, net_active_window, XCB_ATOM_WINDOW, 0, 1);
+    active_pending = 1;
+    xcb_flush(focus_conn);
+}
+
+static WindowCacheEntry* window_cache_slot(xcb_window_t window) {
+    uint32_t hash = (uint32_t)window * 2654435761u;
+    return &window_cache[hash % WINDOW_CACHE_SIZE];
+}
+
+static WindowCacheEntry* window_cache_find(xcb_window_t window) {
+    WindowCacheEntry* entry = window_cache_slot(window);
+    if (entry->window != window || (!entry->has_client && !entry->has_info)) {
+        return NULL;
+    }
+    return entry;
+}
+
+static WindowCacheEntry* window_cache_insert(xcb_connection_t *conn, xcb_window_t window) {
+    WindowCacheEntry* entry = window_cache_slot(window);
+    if (entry->window == window && (entry->has_client || entry->has_info)) {
+        return entry;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->window = window;
+
+    // Ask for the events that invalidate this entry. No reply is needed,
+    // the request goes out together with the next one we flush. The mask
+    // replaces ours on the window, so a top-level keeps its crossing events.
+    watch_window(conn, window);
+
+    return entry;
+}
+
+// Frames that resolved to this window as their client are stale
+static void window_cache_forget_client(xcb_window_t window) {
+    for (int i = 0; i < WINDOW_CACHE_SIZE; i++) {
+        if (window_cache[i].has_client && window_cache[i].client == window) {
+            window_cache[i].has_client = 0;
+            window_cache[i].client = XCB_NONE;
+        }
+    }
+}
+
+static void window_cache_invalidate(xcb_window_t window) {
+    WindowCacheEntry* entry = window_cache_find(window);
+    if (entry) {
+        msg(LOG_DEBUG, "Window cache: dropping %u", window);
+        memset(entry, 0, sizeof(*entry));
+    }
+
+    window_cache_forget_client(window);
+}
+
+void window_cache_clear(void) {
+    memset(window_cache, 0, sizeof(window_cache));
+}
+
+void window_cache_handle_event(xcb_generic_event_t *event) {
+    switch (event->response_type & ~0x80) {
+        case 0: {
+            // BadWindow for a window we selected events on, it is already gone
+            xcb_generic_error_t *error = (xcb_generic_error_t *)event;
+            if (error->error_code == XCB_WINDOW) {
+                window_cache_invalidate(((xcb_window_error_t *)error)->bad_value);
+            }
+            break;
+        }
+        case XCB_PROPERTY_NOTIFY: {
+            xcb_property_notify_event_t *ev = (xcb_property_notify_event_t *)event;
+            if (ev->window == screen->root && ev->atom == net_active_window && net_active_window != XCB_NONE) {
+                request_active_window();
+            } else if (ev->atom == XCB_ATOM_WM_CLASS) {
+                WindowCacheEntry* entry = window_cache_find(ev->window);
+                if (entry) {
+                    msg(LOG_DEBUG, "Window cache: WM_CLASS changed on %u", ev->window);
+                    entry->has_info = 0;
+                }
+            } else if (ev->atom == wm_state && wm_state != XCB_NONE) {
+                // A top-level cached as its own client is being managed now
+                WindowCacheEntry* entry = window_cache_find(ev->window);
+                if (entry && entry->has_client) {
+                    msg(LOG_DEBUG, "Window cache: WM_STATE changed on %u", ev->window);
+                    entry->has_client = 0;
+                }
+            }
+            break;
+        }
+        case XCB_DESTROY_NOTIFY: {
+            xcb_destroy_notify_event_t *ev = (xcb_destroy_notify_event_t *)event;
+            window_cache_invalidate(ev->window);
+            remove_toplevel(ev->window);
+            break;
+        }
+        case XCB_CREATE_NOTIFY: {
+            xcb_create_notify_event_t *ev = (xcb_create_notify_event_t *)event;
+            if (ev->parent == screen->root) {
+                add_toplevel(connection, ev->window);
+            }
+            break;
+        }
+        case XCB_REPARENT_NOTIFY: {
+            xcb_reparent_notify_event_t *ev = (xcb_reparent_notify_event_t *)event;
+
+            // A client moved out of its frame, or a window into a frame we
+            // already resolved, leaves that frame's client to be searched again
+            window_cache_forget_client(ev->window);
+            WindowCacheEntry* parent = window_cache_find(ev->parent);
+            if (parent) {
+                parent->has_client = 0;
+            }
+
+            if (ev->parent == screen->root) {
+                add_toplevel(connection, ev->window);
+            } else if (ev->event == screen->root) {
+                remove_toplevel(ev->window);
+            }
+            break;
+        }
+        case XCB_ENTER_NOTIFY: {
+            // Crossings from a grab starting or ending follow the grab
+            // window, not the pointer, which is asked for again
+            xcb_enter_notify_event_t *ev = (xcb_enter_notify_event_t *)event;
+            if (ev->mode != XCB_NOTIFY_MODE_NORMAL) {
+                pointer_known = 0;
+            } else if (find_toplevel(ev->event) >= 0) {
+                pointer_toplevel = ev->event;
+                pointer_known = 1;
+            }
+            break;
+        }
+        case XCB_LEAVE_NOTIFY: {
+            // Leaving into a child is not leaving
+            xcb_leave_notify_event_t *ev = (xcb_leave_notify_event_t *)event;
+            if (ev->mode != XCB_NOTIFY_MODE_NORMAL) {
+                pointer_known = 0;
+            } else if (ev->event == pointer_toplevel && ev->detail != XCB_NOTIFY_DETAIL_INFERIOR) {
+                pointer_toplevel = XCB_NONE;
+            }
+            break;
+        }
+    }
+}
+
+void init_pointer_tracking(xcb_connection_t *conn) {
+    // Created if need be, a window manager started after us uses it too
+    wm_state = intern_atom(conn, "WM_STATE", 0);
+
+    select_root_events(conn, XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY);
+
+    xcb_query_tree_cookie_t cookie = xcb_query_tree(conn, screen->root);
+    xcb_query_tree_reply_t *reply = xcb_query_tree_reply(conn, cookie, NULL);
+    if (!reply) {
+        msg(LOG_WARNING, "Cannot list top-level windows, the pointer window is queried on every press");
+        return;
+    }
+
+    xcb_window_t *children = xcb_query_tree_children(reply);
+    for (int i = 0; i < xcb_query_tree_children_length(reply); i++) {
+        add_toplevel(conn, children[i]);
+    }
+    free(reply);
+    xcb_flush(conn);
+
+    msg(LOG_DEBUG, "Tracking the pointer over %d top-level windows", toplevel_count);
+}
+
+void cleanup_window_tracking(void) {
+    lookup_free_replies();
+    lookup.step = LOOKUP_IDLE;
+    free(toplevels);
+    toplevels = NULL;
+    toplevel_count = toplevel_capacity = 0;
+    pointer_known = 0;
+}
+
+static WindowClassInfo parse_class_info(const xcb_get_property_reply_t *reply) {
+    WindowClassInfo info = {0, 0, 0};
+
+    if (reply && reply->type == XCB_ATOM_STRING && reply->format == 8 && reply->length > 0) {
+
+        char *data = (char *)xcb_get_property_value(reply);
+        int len = xcb_get_property_value_length(reply);
+
+        if (len > 0) {
+            // "instance\0class\0", the last terminator is not guaranteed
+            int instance_len = strnlen(data, len);
+            info.instance = intern_len(data, instance_len);
+            if (instance_len + 1 < len) {
+                char *class_name = data + instance_len + 1;
+                info.class_name = intern_len(class_name, strnlen(class_name, len - instance_len - 1));
+            }
+
+            info.valid = 1;
+        }
+    }
+    return info;
+}
+
+static WindowClassInfo cache_class_info(xcb_connection_t *conn, xcb_window_t window,
+                                        const xcb_get_property_reply_t *reply) {
+    WindowCacheEntry* entry = window_cache_insert(conn, window);
+    entry->info = parse_class_info(reply);
+    entry->has_info = 1;
+    return entry->info;
+}
+
+static xcb_get_property_cookie_t request_class_info(xcb_connection_t *conn, xcb_window_t window) {
+    return xcb_get_property(conn, 0, window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, 1024);
+}
+
+static void lookup_send(int step) {
+    lookup.step = step;
+    lookup.received = 0;
+    lookup.queried = 1;
+}
+
+static void lookup_finish(xcb_window_t window, WindowClassInfo info) {
+    lookup.result.window = window;
+    lookup.result.info = info;
+    lookup.step = LOOKUP_IDLE;
+
+    if (lookup.queried) {
+        latency_record(LATENCY_LOOKUP, lookup.start);
+    }
+    if (verbose && window != XCB_NONE) {
+        msg(LOG_DEBUG, "Target window found: %u (instance='%s', class='%s')",
+                    window, intern_name(info.instance), intern_name(info.class_name));
+    }
+}
+
+// Ask for WM_STATE, WM_CLASS and the children of every window on the
+// level being searched, WM_CLASS so that finding the client needs no
+// further round trip
+static void lookup_send_level(xcb_connection_t *conn) {
+    for (int i = 0; i < lookup.count; i++) {
+        unsigned int *sequences = &lookup.sequences[i * LOOKUP_REPLIES];
+        sequences[0] = xcb_get_property(conn, 0, lookup.level[i], wm_state, XCB_ATOM_ANY, 0, 0).sequence;
+        sequences[1] = request_class_info(conn, lookup.level[i]).sequence;
+        sequences[2] = xcb_query_tree(conn, lookup.level[i]).sequence;
+    }
+    lookup.sent = lookup.count * LOOKUP_REPLIES;
+    lookup_send(LOOKUP_CLIENT);
+}
+
+static void lookup_send_class(xcb_connection_t *conn, xcb_window_t window) {
+    lookup.level[0] = window;
+    lookup.sequences[0] = request_class_info(conn, window).sequence;
+    lookup.sent = 1;
+    lookup_send(LOOKUP_CLASS);
+}
+
+// A top-level with no WM_STATE below it is its own client until a window
+// manager takes it over, which sets WM_STATE on it or reparents it
+static WindowCacheEntry* cache_own_client(xcb_connection_t *conn, xcb_window_t frame) {
+    WindowCacheEntry* entry = window_cache_insert(conn, frame);
+    entry->client = frame;
+    entry->has_client = 1;
+    return entry;
+}
+
+// The top-level under the pointer is known; 1 when the rest came from the caches too
+static int lookup_from_frame(xcb_connection_t *conn, xcb_window_t frame) {
+    WindowClassInfo none = {0, 0, 0};
+    lookup.frame = frame;
+
+    if (frame == XCB_NONE || frame == screen->root) {
+        lookup_finish(XCB_NONE, none);
+        return 1;
+    }
+
+    WindowCacheEntry* entry = window_cache_find(frame);
+    if (entry && entry->has_client) {
+        WindowCacheEntry* client = window_cache_find(entry->client);
+        if (client && client->has_info) {
+            lookup_finish(entry->client, client->info);
+            return 1;
+        }
+        lookup_send_class(conn, entry->client);
+        return 0;
+    }
+
+    if (wm_state == XCB_NONE) {
+        cache_own_client(conn, frame);
+        lookup_send_class(conn, frame);
+        return 0;
+    }
+
+    lookup.level[0] = frame;
+    lookup.count = 1;
+    lookup.depth = 0;
+    lookup_send_level(conn);
+    return 0;
+}
+
+// Breadth-first search below a top-level for the window carrying
+// WM_STATE, one level per step
+static void lookup_client_level(xcb_connection_t *conn) {
+    for (int i = 0; i < lookup.count; i++) {
+        xcb_get_property_reply_t *state = lookup.replies[i * LOOKUP_REPLIES];
+        if (!state || state->type == XCB_NONE) continue;
+
+        // Caching the client watches it, its DestroyNotify or
+        // ReparentNotify then makes the mapping stale
+        xcb_window_t client = lookup.level[i];
+        WindowClassInfo info = cache_class_info(conn, client, lookup.replies[i * LOOKUP_REPLIES + 1]);
+        WindowCacheEntry* entry = window_cache_insert(conn, lookup.frame);
+        entry->client = client;
+        entry->has_client = 1;
+
+        lookup_free_replies();
+        lookup_finish(client, info);
+        return;
+    }
+
+    if (lookup.depth == 0) {
+        lookup.frame_info = parse_class_info(lookup.replies[1]);
+    }
+
+    xcb_window_t next[CLIENT_SEARCH_WIDTH];
+    int next_count = 0;
+    for (int i = 0; i < lookup.count; i++) {
+        xcb_query_tree_reply_t *tree = lookup.replies[i * LOOKUP_REPLIES + 2];
+        if (!tree) continue;
+
+        xcb_window_t *children = xcb_query_tree_children(tree);
+        int length = xcb_query_tree_children_length(tree);
+        for (int j = 0; j < length && next_count < CLIENT_SEARCH_WIDTH; j++) {
+            next[next_count++] = children[j];
+        }
+    }
+    lookup_free_replies();
+
+    if (++lookup.depth < CLIENT_SEARCH_DEPTH && next_count > 0) {
+        memcpy(lookup.level, next, next_count * sizeof(*next));
+        lookup.count = next_count;
+        lookup_send_level(conn);
+        return;
+    }
+
+    // Without a window manager the top-level is the client
+    msg(LOG_DEBUG, "No WM_STATE below %u, using it as target", lookup.frame);
+    WindowCacheEntry* entry = cache_own_client(conn, lookup.frame);
+    entry->info = lookup.frame_info;
+    entry->has_info = 1;
+    lookup_finish(lookup.frame, lookup.frame_info);
+}
+
+// Replies arrive in request order, so the first one missing ends the poll
+static int lookup_collect(xcb_connection_t *conn) {
+    while (lookup.received < lookup.sent) {
+        void *reply = NULL;
+        if (!xcb_poll_for_reply(conn, lookup.sequences[lookup.received], &reply, NULL)) {
+            return 0;
+        }
+        lookup.replies[lookup.received++] = reply;
+    }
+    return 1;
+}
+
+static int lookup_advance(xcb_connection_t *conn) {
+    while (lookup.step != LOOKUP_IDLE) {
+        if (!lookup_collect(conn)) {
+            return 0;
+        }
+
+        switch (lookup.step) {
+            case LOOKUP_POINTER: {
+                xcb_query_pointer_reply_t *reply = lookup.replies[0];
+                xcb_window_t window = reply ? reply->child : XCB_NONE;
+
+                // Tracked windows report every later crossing
+                if (reply && (window == XCB_NONE || find_toplevel(window) >= 0)) {
+                    pointer_toplevel = window;
+                    pointer_known = 1;
+                }
+                lookup_free_replies();
+                lookup_from_frame(conn, window);
+                break;
+            }
+            case LOOKUP_CLIENT:
+                lookup_client_level(conn);
+                break;
+            case LOOKUP_CLASS: {
+                WindowClassInfo info = cache_class_info(conn, lookup.level[0], lookup.replies[0]);
+                lookup_free_replies();
+                lookup_finish(lookup.level[0], info);
+                break;
+            }
+        }
+
+        if (lookup.step != LOOKUP_IDLE) {
+            xcb_flush(conn);
+        }
+    }
+    return 1;
+}
+
+int window_lookup_start(xcb_connection_t *conn) {
+    if (lookup.step != LOOKUP_IDLE) {
+        return 0;
+    }
+
+    lookup.start = latency_now();
+    lookup.queried = 0;
+
+    // The pointer is kept current by crossing events; it is only asked
+    // for before the first one and after its window went away
+    if (pointer_known && lookup_from_frame(conn, pointer_toplevel)) {
+        return 1;
+    }
+
+    if (!pointer_known) {
+        lookup.sequences[0] = xcb_query_pointer(conn, screen->root).sequence;
+        lookup.sent = 1;
+        lookup_send(LOOKUP_POINTER);
+    }
+    xcb_flush(conn);
+    return 0;
+}
+
+int window_lookup_poll(xcb_connection_t *conn) {
+    return lookup_advance(conn);
+}
+
+WindowTarget window_lookup_result(void) {
+    return lookup.result;
+}
+
+void init_focus_tracking(xcb_connection_t *conn) {
+    focus_conn = conn;
+
+    net_active_window = intern_atom(conn, "_NET_ACTIVE_WINDOW", 1);
+
+    if (net_active_window == XCB_NONE) {
+        msg(LOG_NOTICE, "No EWMH window manager, the active window is not tracked");
+        return;
+    }
+
+    select_root_events(conn, XCB_EVENT_MASK_PROPERTY_CHANGE);
+    request_active_window();
+}
+
+// Never waits, the main thread must not block on X. A reply that is not
+// in yet leaves the active window unknown, which focuses the target.
+xcb_window_t get_active_window(void) {
+    if (active_pending) {
+        xcb_get_property_reply_t *reply = NULL;
+        if (!xcb_poll_for_reply(focus_conn, active_cookie.sequence, (void **)&reply, NULL)) {
+            return XCB_NONE;
+        }
+        active_pending = 0;
+
+        active_window = XCB_NONE;
+        if (reply && reply->type == XCB_ATOM_WINDOW && reply->format == 32 &&
+            xcb_get_property_value_length(reply) >= (int)sizeof(xcb_window_t)) {
+            active_window = *(xcb_window_t *)xcb_get_property_value(reply);
+        }
+        free(reply);
+    }
+    return active_window;
+}
+
+void set_active_window(xcb_window_t window) {
+    // Untracked, every shortcut keeps focusing its window
+    if (net_active_window == XCB_NONE) return;
+
+    // We just focused it ourselves, an older answer in flight is stale
+    if (active_pending) {
+        xcb_discard_reply(focus_conn, active_cookie.sequence);
+        active_pending = 0;
+    }
+    active_window = window;
+}
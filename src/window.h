@@ -0,0 +1,36 @@
+#pragma once
+
+#include <xcb/xcb.h>
+
+#include "eeka.h"
+
+#define WINDOW_CACHE_SIZE 256
+
+extern xcb_connection_t *connection;
+extern xcb_screen_t *screen;
+
+typedef struct {
+    xcb_window_t window;
+    xcb_window_t client;
+    WindowClassInfo info;
+    int has_client;
+    int has_info;
+} WindowCacheEntry;
+
+// The client window under the pointer, XCB_NONE over the root
+typedef struct {
+    xcb_window_t window;
+    WindowClassInfo info;
+} WindowTarget;
+
+int             window_lookup_start(xcb_connection_t *conn);
+int             window_lookup_poll(xcb_connection_t *conn);
+WindowTarget    window_lookup_result(void);
+void            window_cache_handle_event(xcb_generic_event_t *event);
+void            window_cache_clear(void);
+void            init_focus_tracking(xcb_connection_t *conn);
+void            init_pointer_tracking(xcb_connection_t *conn);
+void            cleanup_window_tracking(void);
+int             window_reserve_toplevels(int capacity);
+xcb_window_t    get_active_window(void);
+void            set_active_window(xcb_window_t window);